@@ -0,0 +1,284 @@
+#include "v473.h"
+#include <cstdio>
+
+extern int v473_lock_tmo;
+
+using namespace V473;
+
+// The registry of Card objects. Cards are added and removed rarely
+// (typically only in the startup script) but the registry may be
+// walked every cycle, so the storage is fixed-sized and the lookup
+// tables for DIP address and interrupt vector are indexed directly.
+
+namespace {
+
+    class Registry {
+	vwpp::v3_0::Mutex mutex;
+
+     public:
+	typedef vwpp::v3_0::Mutex::PMLock<Registry, &Registry::mutex> LockType;
+
+	CardInfo entry[maxCards];
+	size_t total;
+	size_t reserved;
+	Card* byAddr[256];
+	Card* byVec[256];
+	SEM_ID sweeping;
+
+	Registry() :
+	    total(0), reserved(0),
+	    sweeping(semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE))
+	{
+	    for (size_t ii = 0; ii < 256; ++ii)
+		byAddr[ii] = byVec[ii] = 0;
+	}
+
+	CardInfo* find(LockType const&, Card const* const card)
+	{
+	    for (size_t ii = 0; ii < total; ++ii)
+		if (entry[ii].card == card)
+		    return entry + ii;
+	    return 0;
+	}
+    } registry;
+
+};
+
+// A card claims its address and vector, and a place in the
+// registry, before it touches the hardware, so two cards being
+// created at once can't both take them. It's only listed, for
+// getCards() and findByOid(), once it's registered.
+
+void V473::reserveCard(Card* const card)
+{
+    Registry::LockType lock(&registry);
+
+    if (registry.total + registry.reserved >= maxCards)
+	throw std::runtime_error("too many V473 cards registered");
+    if (registry.byAddr[card->address()] || registry.byVec[card->vector()])
+	throw std::runtime_error("V473 address or vector already registered");
+
+    registry.byAddr[card->address()] = card;
+    registry.byVec[card->vector()] = card;
+    ++registry.reserved;
+}
+
+void V473::registerCard(Card* const card)
+{
+    Registry::LockType lock(&registry);
+    CardInfo& info = registry.entry[registry.total++];
+
+    --registry.reserved;
+    info.card = card;
+    info.oid = noOid;
+    info.addr = card->address();
+    info.vec = card->vector();
+}
+
+// Removes the card, then waits for any sweep that may have picked it
+// up to finish, so the card can be freed once this returns.
+
+void V473::unregisterCard(Card* const card)
+{
+    {
+	Registry::LockType lock(&registry);
+	CardInfo* const info = registry.find(lock, card);
+
+	if (info) {
+	    registry.byAddr[info->addr] = 0;
+	    registry.byVec[info->vec] = 0;
+	    *info = registry.entry[--registry.total];
+	} else if (registry.byAddr[card->address()] == card) {
+	    registry.byAddr[card->address()] = 0;
+	    registry.byVec[card->vector()] = 0;
+	    --registry.reserved;
+	}
+    }
+    semTake(registry.sweeping, WAIT_FOREVER);
+    semGive(registry.sweeping);
+}
+
+CardSweep::CardSweep()
+{
+    semTake(registry.sweeping, WAIT_FOREVER);
+}
+
+CardSweep::~CardSweep()
+{
+    semGive(registry.sweeping);
+}
+
+void V473::setCardOid(Card* const card, unsigned short const oid)
+{
+    Registry::LockType lock(&registry);
+    CardInfo* const info = registry.find(lock, card);
+
+    if (info)
+	info->oid = oid;
+}
+
+Card* V473::findByOid(unsigned short const oid)
+{
+    Registry::LockType lock(&registry);
+
+    for (size_t ii = 0; ii < registry.total; ++ii)
+	if (registry.entry[ii].oid == oid)
+	    return registry.entry[ii].card;
+    return 0;
+}
+
+// A card that has only reserved its address and vector is still
+// being probed, so it isn't found.
+
+Card* V473::findByAddress(uint8_t const addr)
+{
+    Registry::LockType lock(&registry);
+    Card* const card = registry.byAddr[addr];
+
+    return card && registry.find(lock, card) ? card : 0;
+}
+
+Card* V473::findByVector(uint8_t const vec)
+{
+    Registry::LockType lock(&registry);
+    Card* const card = registry.byVec[vec];
+
+    return card && registry.find(lock, card) ? card : 0;
+}
+
+size_t V473::getCards(CardInfo* const ptr, size_t const n)
+{
+    Registry::LockType lock(&registry);
+    size_t const total = std::min(n, registry.total);
+
+    for (size_t ii = 0; ii < total; ++ii)
+	ptr[ii] = registry.entry[ii];
+    return total;
+}
+
+// Starts a power supply status read on the first card, then
+// recursively does the same for the rest of them. The reply from
+// each card is collected as the recursion unwinds, so every card's
+// lock is held -- and every card is busy -- at the same time.
+
+static void sweepChannel(CardStatus* const sts, size_t const n,
+			 uint16_t const chan)
+{
+    if (n) {
+	try {
+	    Card* const card = sts->info.card;
+	    Card::LockType lock(card, v473_lock_tmo);
+
+	    bool const started = card->startPowerSupplyStatus(lock, chan);
+
+	    sweepChannel(sts + 1, n - 1, chan);
+	    if (!started || !card->finishRead(lock, sts->psStatus + chan, 1))
+		sts->okay = false;
+	}
+	catch (std::exception const&) {
+	    sts->okay = false;
+	    sweepChannel(sts + 1, n - 1, chan);
+	}
+    }
+}
+
+size_t V473::sweepStatus(CardStatus* const sts, size_t const n)
+{
+    CardSweep const sweep;
+    CardInfo info[maxCards];
+    size_t const total = getCards(info, std::min(n, maxCards));
+
+    for (size_t ii = 0; ii < total; ++ii) {
+	sts[ii].info = info[ii];
+	sts[ii].okay = true;
+	for (size_t chan = 0; chan < 4; ++chan)
+	    sts[ii].psStatus[chan] = 0;
+    }
+
+    for (uint16_t chan = 0; chan < 4; ++chan)
+	sweepChannel(sts, total, chan);
+    return total;
+}
+
+// Displays a one-line summary of every registered card.
+
+STATUS v473_show()
+{
+    CardSweep const sweep;
+    CardStatus sts[maxCards];
+    size_t const total = sweepStatus(sts, maxCards);
+
+    printf("OID   ADDR VEC  IRQSRC  PS0   PS1   PS2   PS3   OBJECT\n");
+    for (size_t ii = 0; ii < total; ++ii) {
+	CardStatus const& cs = sts[ii];
+
+	if (cs.info.oid != noOid)
+	    printf("%-5u ", cs.info.oid);
+	else
+	    printf("----  ");
+	printf("0x%02x 0x%02x 0x%04x  ", cs.info.addr, cs.info.vec,
+	       cs.info.card->getIrqSource());
+	if (cs.okay)
+	    printf("%04x  %04x  %04x  %04x  ", cs.psStatus[0],
+		   cs.psStatus[1], cs.psStatus[2], cs.psStatus[3]);
+	else
+	    printf("----  ----  ----  ----  ");
+	printf("%p\n", cs.info.card);
+    }
+    printf("%u card(s) registered.\n", total);
+    return OK;
+}
+
+// Enables, or disables, the waveforms of every channel on every
+// card in the crate.
+
+STATUS v473_enable_all(int const en)
+{
+    CardSweep const sweep;
+    CardInfo info[maxCards];
+    size_t const total = getCards(info, maxCards);
+    STATUS result = OK;
+
+    for (size_t ii = 0; ii < total; ++ii)
+	try {
+	    Card::LockType lock(info[ii].card, v473_lock_tmo);
+
+	    for (size_t chan = 0; chan < 4; ++chan)
+		if (!info[ii].card->waveformEnable(lock, chan, en != 0)) {
+		    printf("ERROR: card at 0x%02x, channel %u didn't "
+			   "respond.\n", info[ii].addr, chan);
+		    result = ERROR;
+		}
+	}
+	catch (std::exception const& e) {
+	    printf("ERROR: card at 0x%02x: %s\n", info[ii].addr, e.what());
+	    result = ERROR;
+	}
+    return result;
+}
+
+// Enables, or disables, TCLK triggering on every card in the crate.
+
+STATUS v473_tclk_enable_all(int const en)
+{
+    CardSweep const sweep;
+    CardInfo info[maxCards];
+    size_t const total = getCards(info, maxCards);
+    STATUS result = OK;
+
+    for (size_t ii = 0; ii < total; ++ii)
+	try {
+	    Card::LockType lock(info[ii].card, v473_lock_tmo);
+
+	    if (!info[ii].card->tclkTrigEnable(lock, en != 0)) {
+		printf("ERROR: card at 0x%02x didn't respond.\n",
+		       info[ii].addr);
+		result = ERROR;
+	    }
+	}
+	catch (std::exception const& e) {
+	    printf("ERROR: card at 0x%02x: %s\n", info[ii].addr, e.what());
+	    result = ERROR;
+	}
+    return result;
+}
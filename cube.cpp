@@ -1,14 +1,12 @@
 #include "v473.h"
 #include <cmath>
+#include <cstdio>
 #include <taskLib.h>
+#include <tickLib.h>
+#include <sysLib.h>
 
 #define M_PI 3.14159265358979323846
 
-typedef float POINT[4];
-typedef float const CPOINT[4];
-typedef float MATRIX[4][4];
-typedef float const CMATRIX[4][4];
-
 static float clip(float val, float limit)
 {
     return std::min(std::max(val, -limit), limit);
@@ -20,107 +18,176 @@ int v473_rotx = 3;
 int v473_roty = 3;
 int v473_rotz = 3;
 
-static void project(CMATRIX m, CPOINT p, float b[2])
-{
-    POINT tmp;
-    float const eye = v473_eye;
+// The demo plays a frame once the card has started the one before
+// it, and no more than `v473_cube_fps` frames a second (0 means as
+// fast as the card takes them.) A positive `v473_cube_ramp_us` sets
+// how long each frame's ramp plays, spread over the cube's edges;
+// otherwise each edge takes `v473_delta` ticks.
+
+int v473_cube_fps = 15;
+int v473_cube_ramp_us = 0;
+
+// The cube's corners and edges. The order the edges are drawn in is
+// planned when the demo starts, so no edge is drawn twice.
+
+static float const cornerX[8] = {
+    -0.5, -0.5,  0.5,  0.5, -0.5, -0.5,  0.5,  0.5
+};
+static float const cornerY[8] = {
+     0.5,  0.5,  0.5,  0.5, -0.5, -0.5, -0.5, -0.5
+};
+static float const cornerZ[8] = {
+    -0.5,  0.5,  0.5, -0.5, -0.5,  0.5,  0.5, -0.5
+};
+
+static V473::VectorDisplay::Edge const edges[] = {
+    { 0, 1 }, { 1, 2 }, { 2, 3 }, { 3, 0 },
+    { 4, 5 }, { 5, 6 }, { 6, 7 }, { 7, 4 },
+    { 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 }
+};
+static size_t const edgeCount = sizeof(edges) / sizeof(*edges);
+static size_t const maxPath = 2 * edgeCount;
+
+static V473::PathStep path[maxPath];
+static size_t pathLen = 0;
+
+// How long to wait for a frame to start playing before replacing it.
+// The demo's $0f event comes at 15 Hz.
+
+static int const startTmo = 100;
+
+// The demo's statistics. Only the demo task writes them, with
+// interrupts locked out, and v473_cube_show() copies them the same
+// way, so it never sees a half-written total.
+
+namespace {
+
+    struct CubeStats {
+	uint32_t start;
+	uint32_t frames;
+	uint32_t missed;
+	uint32_t failed;
+	uint32_t uploads;
+	uint32_t uploadMax;
+	uint64_t uploadTotal;
+	V473::Histogram upload;
+    };
+}
 
-    for (size_t row = 0; row < 3; ++row)
-	for (size_t col = 0; col < 4; ++col)
-	    tmp[row] =
-		m[row][0] * p[0] +
-		m[row][1] * p[1] +
-		m[row][2] * p[2] +
-		m[row][3];
+static CubeStats stats;
 
-    b[0] = clip(tmp[0] * eye / (tmp[2] + eye), 2.f);
-    b[1] = clip(tmp[1] * eye / (tmp[2] + eye), 2.f);
-}
+// Sines of whole degrees, with an extra quarter turn so that
+// cos(a) is sinDeg[a + 90]. Filled, and the path planned, the first
+// time they're needed.
 
-void dumpMatrix(CMATRIX m)
-{
-    for (size_t ii = 0; ii < 4; ++ii)
-	printf("    | %6.3f %6.3f %6.3f %6.3f |\n",
-	       m[ii][0], m[ii][1], m[ii][2], m[ii][3]);
-}
+static float sinDeg[360 + 90];
+static bool cubeReady = false;
 
-static void product(CMATRIX const p, MATRIX m)
+static void initCube()
 {
-    MATRIX tmp;
-
-    for (size_t row = 0; row < 4; ++row)
-	for (size_t col = 0; col < 4; ++col)
-	    tmp[row][col] =
-		m[row][0] * p[0][col] +
-		m[row][1] * p[1][col] +
-		m[row][2] * p[2][col] +
-		m[row][3] * p[3][col];
-    for (size_t row = 0; row < 4; ++row)
-	for (size_t col = 0; col < 4; ++col)
-	    m[row][col] = tmp[row][col];
+    if (!cubeReady) {
+	for (size_t ii = 0; ii < 360 + 90; ++ii)
+	    sinDeg[ii] = (float) sin((2.0 * M_PI / 360.0) * ii);
+	pathLen = V473::planPath(edges, edgeCount, 8, path);
+	cubeReady = true;
+    }
 }
 
-static void identity(MATRIX m)
-{
-    m[0][0] = m[1][1] = m[2][2] = m[3][3] = 1.0;
-    m[0][1] = m[0][2] = m[0][3] = m[1][0] = m[1][2] = m[1][3] = m[2][0] =
-	m[2][1] = m[2][3] = m[3][0] = m[3][1] = m[3][2] = 0.0;
-}
+// The rotation about X, then Y, then Z, multiplied out into one
+// matrix. Angles are whole degrees in [0, 360).
 
-static void translate(MATRIX m, float const dx, float const dy,
-		      float const dz)
+static void rotation(int const xa, int const ya, int const za,
+		     float m[3][3])
 {
-    m[3][0] += dx;
-    m[3][1] += dy;
-    m[3][2] += dz;
+    float const sx = sinDeg[xa], cx = sinDeg[xa + 90];
+    float const sy = sinDeg[ya], cy = sinDeg[ya + 90];
+    float const sz = sinDeg[za], cz = sinDeg[za + 90];
+
+    m[0][0] = cy * cz;
+    m[0][1] = -cy * sz;
+    m[0][2] = -sy;
+    m[1][0] = sx * sy * cz + cx * sz;
+    m[1][1] = cx * cz - sx * sy * sz;
+    m[1][2] = sx * cy;
+    m[2][0] = cx * sy * cz - sx * sz;
+    m[2][1] = -cx * sy * sz - sx * cz;
+    m[2][2] = cx * cy;
 }
 
-void rotateX(MATRIX m, float const a)
+// Transforms and projects the eight corners in one pass, then lays
+// the path into the X and Y ramps. Each corner is projected once,
+// however often the path visits it. Returns the words per ramp.
+
+static size_t renderFrame(int const xa, int const ya, int const za,
+			  uint16_t* const rampX, uint16_t* const rampY)
 {
-    float const r = (2.0 * M_PI / 360.0) * a;
-    float const s = sin(r);
-    float const c = cos(r);
-
-    CMATRIX mx = {
-	{1., 0., 0., 0.},
-	{0.,  c,  s, 0.},
-	{0., -s,  c, 0.},
-	{0., 0., 0., 1.}
-    };
+    float m[3][3];
+    float const eye = v473_eye;
+    int16_t bx[8];
+    int16_t by[8];
+
+    rotation(xa, ya, za, m);
+
+    for (size_t ii = 0; ii < 8; ++ii) {
+	float const x = m[0][0] * cornerX[ii] + m[0][1] * cornerY[ii] +
+	    m[0][2] * cornerZ[ii];
+	float const y = m[1][0] * cornerX[ii] + m[1][1] * cornerY[ii] +
+	    m[1][2] * cornerZ[ii];
+	float const z = m[2][0] * cornerX[ii] + m[2][1] * cornerY[ii] +
+	    m[2][2] * cornerZ[ii];
+	float const w = eye / (z + eye);
+
+	bx[ii] = (int16_t) (clip(x * w, 2.f) * 16000.f);
+	by[ii] = (int16_t) (clip(y * w, 2.f) * 16000.f);
+    }
 
-    product(mx, m);
-}
+    int const dwell = v473_cube_ramp_us > 0 ?
+	v473_cube_ramp_us / (10 * (int) edgeCount) : v473_delta;
+    uint16_t const delta = (uint16_t) std::min(std::max(dwell, 1), 0xffff);
 
-void rotateY(MATRIX m, float const a)
-{
-    float const r = (2.0 * M_PI / 360.0) * a;
-    float const s = sin(r);
-    float const c = cos(r);
-
-    CMATRIX my = {
-	{ c, 0., -s, 0.},
-	{0., 1., 0., 0.},
-	{ s, 0.,  c, 0.},
-	{0., 0., 0., 1.}
-    };
+    // Jumps between trails are as quick as the card allows.
 
-    product(my, m);
+    for (size_t ii = 0; ii < pathLen; ++ii) {
+	rampX[ii * 2] = (uint16_t) bx[path[ii].vertex];
+	rampY[ii * 2] = (uint16_t) by[path[ii].vertex];
+	rampX[ii * 2 + 1] = rampY[ii * 2 + 1] = path[ii].draw ? delta : 1;
+    }
+    rampX[pathLen * 2] = rampX[pathLen * 2 - 2];
+    rampY[pathLen * 2] = rampY[pathLen * 2 - 2];
+    rampX[pathLen * 2 + 1] = rampY[pathLen * 2 + 1] = 0;
+    return (pathLen + 1) * 2;
 }
 
-void rotateZ(MATRIX m, float const a)
+// Renders `n` frames, rotating as the demo does, and reports the
+// frame rate the projection alone could sustain.
+
+STATUS v473_cube_bench(int const n)
 {
-    float const r = (2.0 * M_PI / 360.0) * a;
-    float const s = sin(r);
-    float const c = cos(r);
-
-    CMATRIX mz = {
-	{ c, -s, 0., 0.},
-	{ s,  c, 0., 0.},
-	{0., 0., 1., 0.},
-	{0., 0., 0., 1.}
-    };
+    if (n <= 0) {
+	printf("usage: v473_cube_bench frames\n");
+	return ERROR;
+    }
+    initCube();
+
+    uint16_t rampX[2 * (maxPath + 1)];
+    uint16_t rampY[2 * (maxPath + 1)];
+    int xa = 0;
+    int ya = 0;
+    int za = 0;
+    uint32_t const t0 = V473::timeStamp();
+
+    for (int ii = 0; ii < n; ++ii) {
+	xa = (xa + v473_rotx + 360) % 360;
+	ya = (ya + v473_roty + 360) % 360;
+	za = (za + v473_rotz + 360) % 360;
+	renderFrame(xa, ya, za, rampX, rampY);
+    }
+
+    uint32_t const usec = V473::tbToUsec(V473::timeStamp() - t0);
 
-    product(mz, m);
+    printf("%d frames in %u us: %u frames/s\n", n, usec,
+	   usec ? (unsigned) ((uint64_t) n * 1000000 / usec) : 0);
+    return OK;
 }
 
 STATUS v473_cube(V473::HANDLE const hw)
@@ -128,9 +195,9 @@ STATUS v473_cube(V473::HANDLE const hw)
     int xa = 0;
     int ya = 0;
     int za = 0;
-    int ramp = 0;
 
     try {
+	initCube();
 	{
 	    // Setup the hardware
 
@@ -177,85 +244,128 @@ STATUS v473_cube(V473::HANDLE const hw)
 	    hw->waveformEnable(lock, 1, true);
 	}
 
-	do {
-	    static size_t const path[] = {
-		0, 1, 2, 3, 7, 6, 5, 4, 0, 3, 2, 6, 7, 4, 5, 1, 0
-	    };
+	V473::Card::PingPong pp;
+	uint16_t const* ramps[4] = { 0, 0, 0, 0 };
+	uint16_t data[2][2 * (maxPath + 1)];
+	int paceFps = 0;
+	uint64_t paceFrames = 0;
+	unsigned long paceStart = 0;
+
+	// Level 0 holds the $0f event, so frames alternate between
+	// levels 0 and 1.
+
+	V473::Card::initPingPong(pp, 0, 0x3);
+	ramps[0] = data[0];
+	ramps[1] = data[1];
+	{
+	    vwpp::v3_0::IntLock const lock;
 
+	    stats.start = V473::timeStamp();
+	    stats.frames = stats.missed = stats.failed = 0;
+	    stats.uploads = stats.uploadMax = 0;
+	    stats.uploadTotal = 0;
+	    stats.upload.clear();
+	}
+
+	do {
 	    // Update rotation
 
 	    xa = (xa + v473_rotx + 360) % 360;
 	    ya = (ya + v473_roty + 360) % 360;
 	    za = (za + v473_rotz + 360) % 360;
 
-	    // Compute transform matrix
-
-	    MATRIX m;
-
-	    identity(m);
-	    rotateX(m, xa);
-	    rotateY(m, ya);
-	    rotateZ(m, za);
-	    translate(m, 0., 0., 2.);
-
-	    // Translate each point and save result into ramp table
-	    // buffer.
-
-	    uint16_t data[2][2 * (sizeof(path) / sizeof(*path) + 1)];
-
-	    for (size_t ii = 0; ii < sizeof(path) / sizeof(*path); ++ii) {
-		static POINT const point[] = {
-		    { -0.5,  0.5, -0.5, 1. },
-		    { -0.5,  0.5,  0.5, 1. },
-		    {  0.5,  0.5,  0.5, 1. },
-		    {  0.5,  0.5, -0.5, 1. },
-		    { -0.5, -0.5, -0.5, 1. },
-		    { -0.5, -0.5,  0.5, 1. },
-		    {  0.5, -0.5,  0.5, 1. },
-		    {  0.5, -0.5, -0.5, 1. }
-		};
-		float b[2];
-
-		project(m, point[path[ii]], b);
-		data[0][ii * 2] = uint16_t(b[0] * 16000.);
-		data[1][ii * 2] = uint16_t(b[1] * 16000.);
-		data[0][ii * 2 + 1] = data[1][ii * 2 + 1] = v473_delta;
-
-		data[0][(ii + 1) * 2] = uint16_t(b[0] * 16000.);
-		data[1][(ii + 1) * 2] = uint16_t(b[1] * 16000.);
-		data[0][(ii + 1) * 2 + 1] = data[1][(ii + 1) * 2 + 1] = 0;
-	    }
+	    size_t const words = renderFrame(xa, ya, za, data[0], data[1]);
 
-	    V473::Card::LockType lock(hw);
+	    // playFrame() asks the card whether the last frame has
+	    // started before it writes to the idle level, so a frame is
+	    // never written over one that's waiting to play.
+
+	    bool const okay = hw->playFrame(pp, ramps, words, startTmo);
+	    uint32_t const usec = V473::tbToUsec(pp.writeTime);
 
 	    {
-		uint8_t const unevent = 0xfe;
+		vwpp::v3_0::IntLock const lock;
+
+		stats.frames = pp.frames;
+		stats.missed = pp.replaced;
+		stats.failed = pp.failed;
+		if (okay) {
+		    stats.upload.record(usec);
+		    ++stats.uploads;
+		    stats.uploadTotal += usec;
+		    stats.uploadMax = std::max(stats.uploadMax, usec);
+		}
+	    }
 
-		hw->setTriggerMap(lock, !ramp, &unevent, 1);
+	    // Hold back to the target rate. A late frame restarts the
+	    // schedule, rather than letting the demo rush to catch up.
 
-		hw->setRamp(lock, 0, ramp + 1, 0, data[0], 2 * (sizeof(path) / sizeof(*path) + 1));
-		hw->setRamp(lock, 1, ramp + 1, 0, data[1], 2 * (sizeof(path) / sizeof(*path) + 1));
+	    int const fps = v473_cube_fps;
 
-		// Hand the $0f event to the interrupt assigned to the
-		// next ramp.
+	    if (fps > 0) {
+		if (fps != paceFps) {
+		    paceFps = fps;
+		    paceFrames = 0;
+		    paceStart = tickGet();
+		}
 
-		uint8_t const event = 0x0f;
+		unsigned long const due = paceStart + (unsigned long)
+		    (++paceFrames * sysClkRateGet() / fps);
+		long const wait = (long) (due - tickGet());
 
-		hw->setTriggerMap(lock, ramp, &event, 1);
+		if (wait > 0)
+		    taskDelay((int) wait);
+		else if (wait < 0)
+		    paceFps = 0;
 	    }
-
-	    // Wait for the ramp to start to play. Then we can switch
-	    // to updating the other ramp.
-
-	    // while (hw->getActiveInterruptLevel(lock) != ramp)
-	    taskDelay(4);
-	    ramp = !ramp;
 	} while (true);
     }
+    catch (int16_t const& e) {
+	printf("error %d\n", e);
+    }
     catch (std::exception const& e) {
 	printf("caught: %s\n", e.what());
-	return ERROR;
+    }
+    return ERROR;
+}
+
+// Prints the demo's frame counts, the frame rate since the last call
+// (or since the demo started) and the time taken to write each frame.
+
+STATUS v473_cube_show()
+{
+    static uint32_t shownStart = 0;
+    static uint32_t shownAt = 0;
+    static uint32_t shownFrames = 0;
+    CubeStats st;
+
+    {
+	vwpp::v3_0::IntLock const lock;
+
+	st = stats;
+    }
+
+    uint32_t const now = V473::timeStamp();
+
+    if (shownStart != st.start || shownFrames > st.frames) {
+	shownStart = shownAt = st.start;
+	shownFrames = 0;
     }
 
+    uint32_t const usec = V473::tbToUsec(now - shownAt);
+    uint64_t const tenths =
+	usec ? (uint64_t) (st.frames - shownFrames) * 10000000 / usec : 0;
+    uint32_t const written = st.uploads ? st.uploads : 1;
+
+    shownAt = now;
+    shownFrames = st.frames;
+    printf("%u frames, %u missed, %u failed: %u.%u frames/s\n", st.frames,
+	   st.missed, st.failed, (unsigned) (tenths / 10),
+	   (unsigned) (tenths % 10));
+    printf("write time %u us average, %u us max\n",
+	   (unsigned) (st.uploadTotal / written), st.uploadMax);
+    printf("WRITE (us)  FRAMES\n");
+    for (size_t ii = 0; ii < V473::Histogram::buckets; ++ii)
+	printf("< %-8u  %u\n", 2u << ii, st.upload[ii]);
     return OK;
 }
@@ -0,0 +1,315 @@
+#include "v473.h"
+#include <cmath>
+#include <cstdio>
+#include <memory>
+
+using namespace V473;
+
+VectorDisplay::VectorDisplay(Card* const c, uint16_t const x,
+			     uint16_t const y, uint16_t const lvl) :
+    card(c), chanX(x), chanY(y), points(0), strokes(0), eye(0.f),
+    scale(16000.f), drawTicks(2000), ramps(0)
+{
+    if (chanX == chanY)
+	throw std::logic_error("X and Y must be different channels");
+    Card::initPingPong(pp, lvl, (1 << chanX) | (1 << chanY));
+
+    float const unit[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+
+    setView(unit, 0.f, 0.f, 0.f, 0.f, scale);
+    stats.pictures = stats.ramps = stats.segments = stats.jumps = 0;
+}
+
+void VectorDisplay::clear()
+{
+    points = strokes = 0;
+}
+
+uint16_t VectorDisplay::addPoint(Point const& p)
+{
+    if (points >= maxPoints)
+	throw std::runtime_error("too many vector display points");
+    point[points] = p;
+    return (uint16_t) points++;
+}
+
+void VectorDisplay::addStroke(uint16_t const p, bool const draw)
+{
+    if (strokes >= maxStrokes)
+	throw std::runtime_error("too many vector display strokes");
+    stroke[strokes].point = p;
+    stroke[strokes].draw = draw;
+    ++strokes;
+}
+
+void VectorDisplay::polyline(Point const* const pts, size_t const n,
+			     bool const closed)
+{
+    if (n < 2)
+	throw std::logic_error("a polyline needs two points");
+
+    uint16_t const first = addPoint(pts[0]);
+
+    addStroke(first, false);
+    for (size_t ii = 1; ii < n; ++ii)
+	addStroke(addPoint(pts[ii]), true);
+    if (closed)
+	addStroke(first, true);
+}
+
+void VectorDisplay::mesh(Point const* const pts, size_t const n,
+			 Edge const* const edge, size_t const edges)
+{
+    if (points + n > maxPoints)
+	throw std::runtime_error("too many vector display points");
+    if (edges > maxStrokes)
+	throw std::runtime_error("too many vector display strokes");
+
+    PathStep* const steps = new PathStep[2 * edges];
+
+    try {
+	size_t const base = points;
+	size_t const count = planPath(edge, edges, n, steps);
+
+	if (strokes + count > maxStrokes)
+	    throw std::runtime_error("too many vector display strokes");
+	for (size_t ii = 0; ii < n; ++ii)
+	    addPoint(pts[ii]);
+	for (size_t ii = 0; ii < count; ++ii)
+	    addStroke((uint16_t) (base + steps[ii].vertex), steps[ii].draw);
+    }
+    catch (...) {
+	delete [] steps;
+	throw;
+    }
+    delete [] steps;
+}
+
+void VectorDisplay::setView(float const rot[3][3], float const dx,
+			    float const dy, float const dz, float const e,
+			    float const counts)
+{
+    if (e < 0.f || counts <= 0.f)
+	throw std::logic_error("bad vector display view");
+    for (size_t row = 0; row < 3; ++row)
+	for (size_t col = 0; col < 3; ++col)
+	    view[row][col] = rot[row][col];
+    shift[0] = dx;
+    shift[1] = dy;
+    shift[2] = dz;
+    eye = e;
+    scale = counts;
+}
+
+void VectorDisplay::setDrawTime(uint16_t const ticks)
+{
+    if (!ticks)
+	throw std::logic_error("draw time must be positive");
+    drawTicks = ticks;
+}
+
+static int16_t toCounts(float const v)
+{
+    return (int16_t) std::min(std::max(v, -32767.f), 32767.f);
+}
+
+// The points are projected in one pass, whatever the number of
+// strokes that visit them. A jump to where the beam already is costs
+// nothing, so it's dropped.
+
+size_t VectorDisplay::render()
+{
+    int16_t px[maxPoints];
+    int16_t py[maxPoints];
+
+    for (size_t ii = 0; ii < points; ++ii) {
+	Point const& p = point[ii];
+	float const x = view[0][0] * p.x + view[0][1] * p.y +
+	    view[0][2] * p.z + shift[0];
+	float const y = view[1][0] * p.x + view[1][1] * p.y +
+	    view[1][2] * p.z + shift[1];
+	float const z = view[2][0] * p.x + view[2][1] * p.y +
+	    view[2][2] * p.z + shift[2];
+	float const w = eye > 0.f ?
+	    scale * eye / std::max(z + eye, 1e-3f) : scale;
+
+	px[ii] = toCounts(x * w);
+	py[ii] = toCounts(y * w);
+    }
+
+    // The drawn length sets each line's share of the draw time.
+
+    float total = 0.f;
+    int32_t lastX = 0;
+    int32_t lastY = 0;
+
+    for (size_t ii = 0; ii < strokes; ++ii) {
+	size_t const p = stroke[ii].point;
+	float const dx = (float) (px[p] - lastX);
+	float const dy = (float) (py[p] - lastY);
+
+	len[ii] = std::sqrt(dx * dx + dy * dy);
+	if (stroke[ii].draw)
+	    total += len[ii];
+	lastX = px[p];
+	lastY = py[p];
+    }
+
+    float const perCount = total > 0.f ? drawTicks / total : 0.f;
+    size_t seg = 0;
+    uint32_t jumps = 0;
+
+    ramps = 0;
+    for (size_t ii = 0; ii < strokes; ++ii) {
+	Stroke const& s = stroke[ii];
+
+	if (!s.draw && ii && len[ii] == 0.f)
+	    continue;
+
+	if (seg == maxSegments) {
+	    ++ramps;
+	    seg = 0;
+	}
+
+	uint16_t* const x = ramp[ramps][0];
+	uint16_t* const y = ramp[ramps][1];
+	float const ticks = s.draw ? len[ii] * perCount + 0.5f : 1.f;
+
+	x[seg * 2] = (uint16_t) px[s.point];
+	y[seg * 2] = (uint16_t) py[s.point];
+	x[seg * 2 + 1] = y[seg * 2 + 1] =
+	    (uint16_t) std::min(std::max(ticks, 1.f), 65535.f);
+	jumps += !s.draw;
+	++seg;
+	++stats.segments;
+    }
+
+    // Terminate each ramp by holding its last point.
+
+    if (seg)
+	++ramps;
+    for (size_t ii = 0; ii < ramps; ++ii) {
+	size_t const n = ii + 1 < ramps ? maxSegments : seg;
+
+	for (size_t xy = 0; xy < 2; ++xy) {
+	    ramp[ii][xy][n * 2] = ramp[ii][xy][n * 2 - 2];
+	    ramp[ii][xy][n * 2 + 1] = 0;
+	}
+	rampWords[ii] = (n + 1) * 2;
+    }
+    stats.jumps += jumps;
+    return ramps;
+}
+
+bool VectorDisplay::play(int const tmo)
+{
+    if (!render())
+	return true;
+
+    uint16_t const* r[4] = { 0, 0, 0, 0 };
+
+    for (size_t ii = 0; ii < ramps; ++ii) {
+	r[chanX] = ramp[ii][0];
+	r[chanY] = ramp[ii][1];
+	if (!card->playFrame(pp, r, rampWords[ii], tmo))
+	    return false;
+	++stats.ramps;
+    }
+    ++stats.pictures;
+    return true;
+}
+
+V473::VectorDisplay* v473_display_create(V473::HANDLE const hw,
+					 int const chanX, int const chanY,
+					 int const lvl)
+{
+    try {
+	return new VectorDisplay(hw, (uint16_t) chanX, (uint16_t) chanY,
+				 (uint16_t) lvl);
+    }
+    catch (int16_t const& e) {
+	printf("error %d\n", e);
+    }
+    catch (std::exception const& e) {
+	printf("caught: %s\n", e.what());
+    }
+    return 0;
+}
+
+STATUS v473_display_show(V473::VectorDisplay* const disp)
+{
+    if (!disp) {
+	printf("usage: v473_display_show display\n");
+	return ERROR;
+    }
+
+    VectorDisplay::Stats const& st = disp->getStats();
+    Card::PingPong const& pp = disp->getPingPong();
+
+    printf("%u pictures in %u ramps, %u segments, %u jumps\n", st.pictures,
+	   st.ramps, st.segments, st.jumps);
+    printf("ramps confirmed %u, replaced %u, failed %u, last write %u us\n",
+	   pp.confirmed, pp.replaced, pp.failed, tbToUsec(pp.writeTime));
+    return OK;
+}
+
+// Renders a sphere drawn as a 12 by 12 grid of latitude and
+// longitude lines `n` times, without a card, and reports the time per
+// picture.
+
+STATUS v473_display_bench(int const n)
+{
+    if (n <= 0) {
+	printf("usage: v473_display_bench pictures\n");
+	return ERROR;
+    }
+
+    size_t const grid = 12;
+    VectorDisplay::Point pts[grid * grid];
+    VectorDisplay::Edge edges[2 * grid * grid];
+    size_t ne = 0;
+
+    for (size_t ii = 0; ii < grid; ++ii)
+	for (size_t jj = 0; jj < grid; ++jj) {
+	    double const lat = 3.141592653589793 * ((ii + 0.5) / grid - 0.5);
+	    double const lon = 6.283185307179586 * jj / grid;
+	    VectorDisplay::Point& p = pts[ii * grid + jj];
+
+	    p.x = (float) (cos(lat) * cos(lon));
+	    p.y = (float) sin(lat);
+	    p.z = (float) (cos(lat) * sin(lon));
+	    edges[ne].from = (uint16_t) (ii * grid + jj);
+	    edges[ne].to = (uint16_t) (ii * grid + (jj + 1) % grid);
+	    ++ne;
+	    if (ii + 1 < grid) {
+		edges[ne].from = (uint16_t) (ii * grid + jj);
+		edges[ne].to = (uint16_t) ((ii + 1) * grid + jj);
+		++ne;
+	    }
+	}
+
+    try {
+	std::auto_ptr<VectorDisplay> const disp(new VectorDisplay(0, 0, 1, 0));
+	float const unit[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+	size_t ramps = 0;
+
+	disp->setView(unit, 0.f, 0.f, 0.f, 2.f, 16000.f);
+	disp->mesh(pts, grid * grid, edges, ne);
+
+	uint32_t const t0 = timeStamp();
+
+	for (int ii = 0; ii < n; ++ii)
+	    ramps = disp->render();
+
+	uint32_t const usec = tbToUsec(timeStamp() - t0);
+
+	printf("%u edges in %u ramps, %u jumps: %u us/picture\n", ne, ramps,
+	       disp->getStats().jumps / n,
+	       (unsigned) ((uint64_t) usec / n));
+	return OK;
+    }
+    catch (std::exception const& e) {
+	printf("caught: %s\n", e.what());
+    }
+    return ERROR;
+}
@@ -0,0 +1,183 @@
+#include "v473.h"
+#include <cstdlib>
+
+using namespace V473;
+
+// When non-zero, writes to the ramps, scale factors, offsets and
+// their maps are checked before they're made. A write that would
+// let an interrupt level drive its channel outside the DAC's range,
+// or faster than the slew limit, is rejected with ERR_BADSET.
+
+int v473_lint = 0;
+
+// The scale factor that means unity is 1 << `v473_lint_scale_shift`.
+// The default, 128, is what v473_test and the cube demo use; it's
+// the stricter choice, since the same factor is twice the gain it
+// would be with 256 as unity.
+
+int v473_lint_scale_shift = 7;
+
+// The largest change of the output, in DAC counts per 10 us tick,
+// a ramp may make after scaling. 0 disables the check.
+
+int v473_lint_slew = 0;
+
+namespace {
+
+    // The range and steepest slope of a ramp, before scaling.
+
+    struct RampBounds {
+	bool known;
+	bool empty;
+	int32_t lo;
+	int32_t hi;
+	int32_t slew;
+    };
+
+    // Copies the part of a write that lands in [base, base + n) of
+    // the channel's memory over `buf`.
+
+    void overlay(uint16_t const base, uint16_t* const buf, size_t const n,
+		 uint16_t const addr, uint16_t const* const ptr,
+		 size_t const len)
+    {
+	size_t const first = std::max<size_t>(base, addr);
+	size_t const last = std::min<size_t>(base + n, addr + len);
+
+	for (size_t ii = first; ii < last; ++ii)
+	    buf[ii - base] = ptr[ii - addr];
+    }
+
+    bool touches(uint16_t const base, size_t const n, uint16_t const addr,
+		 size_t const len)
+    {
+	return addr < base + n && base < addr + len;
+    }
+
+    // The output moves linearly between segment values, so the
+    // extremes are segment values. The first segment starts from
+    // wherever the output was, so it doesn't count toward the slew.
+
+    void rampBounds(uint16_t const* const ramp, RampBounds& b)
+    {
+	b.known = true;
+	b.empty = !ramp[1];
+	b.lo = b.hi = (int16_t) ramp[0];
+	b.slew = 0;
+
+	for (size_t seg = 1; seg <= maxSegments && ramp[seg * 2 + 1]; ++seg) {
+	    int32_t const v = (int16_t) ramp[seg * 2];
+	    int32_t const d = ramp[seg * 2 + 1];
+	    int32_t const step = std::abs(v - (int16_t) ramp[seg * 2 - 2]);
+
+	    b.lo = std::min(b.lo, v);
+	    b.hi = std::max(b.hi, v);
+	    b.slew = std::max(b.slew, (step + d - 1) / d);
+	}
+    }
+}
+
+// Checks a write of `n` words at `addr`, an offset into a channel's
+// memory map, against the rest of the channel's configuration. The
+// configuration comes from the driver's copy, read from the card
+// the first time it's needed. Only interrupt levels that use
+// something the write changes are checked, so an existing bad
+// setting doesn't block unrelated writes.
+
+void Card::lintWrite(Card::LockType const& lock, Channel const& chan,
+		     uint16_t const addr, uint16_t const* const ptr,
+		     size_t const n)
+{
+    if (!v473_lint || addr >= cpDelays ||
+	(addr >= cpRampMap && !touches(cpRampMap, 0x20, addr, n) &&
+	 !touches(cpScaleFactorMap, 0x40, addr, n) &&
+	 !touches(cpOffsetMap, 0x40, addr, n)))
+	return;
+
+    uint16_t rampMap[32], scaleMap[32], offsetMap[32];
+    uint16_t scales[32], offsets[32], mode;
+    bool const saved = cachedReads;
+    bool okay;
+
+    cachedReads = true;
+    okay = getRampMap(lock, chan, 0, rampMap, 32) &&
+	getScaleFactorMap(lock, chan, 0, scaleMap, 32) &&
+	getOffsetMap(lock, chan, 0, offsetMap, 32) &&
+	getScaleFactors(lock, chan, 0, scales + 1, 31) &&
+	getOffsets(lock, chan, 0, offsets, 32) &&
+	getSineWaveMode(lock, chan, &mode);
+    cachedReads = saved;
+
+    // Without the configuration there's nothing to check against;
+    // the write goes ahead and the card reports any trouble.
+
+    if (!okay)
+	return;
+
+    scales[0] = 0;
+    overlay(cpRampMap, rampMap, 32, addr, ptr, n);
+    overlay(cpScaleFactorMap, scaleMap, 32, addr, ptr, n);
+    overlay(cpOffsetMap, offsetMap, 32, addr, ptr, n);
+    overlay(cpScaleFactors, scales, 32, addr, ptr, n);
+    overlay(cpOffsets, offsets, 32, addr, ptr, n);
+
+    RampBounds bounds[16];
+    unsigned const shift = v473_lint_scale_shift;
+
+    for (size_t ii = 0; ii < 16; ++ii)
+	bounds[ii].known = false;
+
+    for (size_t lvl = 0; lvl < 32; ++lvl) {
+	uint16_t const r = rampMap[lvl];
+	uint16_t const s = scaleMap[lvl];
+	uint16_t const o = offsetMap[lvl];
+
+	if (r >= 16 || s < 1 || s >= 32 || o >= 32 ||
+	    !(touches(r << 7, 128, addr, n) ||
+	      touches(cpScaleFactors + s, 1, addr, n) ||
+	      touches(cpOffsets + o, 1, addr, n) ||
+	      touches(cpRampMap + lvl, 1, addr, n) ||
+	      touches(cpScaleFactorMap + lvl, 1, addr, n) ||
+	      touches(cpOffsetMap + lvl, 1, addr, n)))
+	    continue;
+
+	RampBounds& b = bounds[r];
+
+	if (!b.known) {
+	    uint16_t ramp[128];
+
+	    cachedReads = true;
+	    okay = getRamp(lock, chan, r, 0, ramp, 128);
+	    cachedReads = saved;
+	    if (!okay)
+		return;
+	    overlay(r << 7, ramp, 128, addr, ptr, n);
+	    rampBounds(ramp, b);
+	}
+	if (b.empty)
+	    continue;
+
+	int32_t const scale = (int16_t) scales[s];
+	int32_t const offset = (int16_t) offsets[o];
+	int32_t lo = b.lo;
+	int32_t hi = b.hi;
+
+	// In sine mode the ramp is the amplitude of a sine wave.
+
+	if (mode) {
+	    hi = std::max(std::abs(lo), std::abs(hi));
+	    lo = -hi;
+	}
+
+	int32_t const a = (lo * scale) >> shift;
+	int32_t const c = (hi * scale) >> shift;
+
+	if (std::min(a, c) + offset < -32768 || std::max(a, c) + offset > 32767)
+	    throw int16_t(ERR_BADSET);
+
+	if (v473_lint_slew > 0 && !mode &&
+	    (b.slew * std::abs(scale) + (1 << shift) - 1) >> shift >
+	    v473_lint_slew)
+	    throw int16_t(ERR_BADSET);
+    }
+}
@@ -0,0 +1,194 @@
+#include "v473.h"
+#include <cstdio>
+
+using namespace V473;
+
+// Generates the ramp generator's output, before scaling, for ticks
+// [0, n). Within a segment the output is a closed-form function of
+// the tick, with the slope in 16.16 fixed point, so the inner loop
+// has no loop-carried dependency and can be vectorized. The output
+// lands exactly on each segment's value at the segment's end.
+
+static size_t rampStage(uint16_t const* const ramp, size_t const words,
+			int16_t const initial, int32_t* const out,
+			size_t const n)
+{
+    int32_t prev = initial;
+    size_t tt = 0;
+
+    for (size_t seg = 0; seg * 2 + 1 < words && tt < n; ++seg) {
+	int32_t const target = (int16_t) ramp[seg * 2];
+	uint32_t const delta = ramp[seg * 2 + 1];
+
+	if (!delta)
+	    break;
+
+	int64_t const slope = ((int64_t) (target - prev) << 16) / delta;
+	size_t const len = std::min<size_t>(delta, n - tt);
+	int32_t* const dst = out + tt;
+
+	for (size_t kk = 0; kk < len; ++kk)
+	    dst[kk] = prev + (int32_t) ((slope * (int64_t) (kk + 1)) >> 16);
+	if (len == delta)
+	    dst[len - 1] = target;
+	tt += len;
+	prev = target;
+    }
+
+    // After the terminator the output holds.
+
+    for (size_t ii = tt; ii < n; ++ii)
+	out[ii] = prev;
+    return tt;
+}
+
+void V473::simulateChannel(ChannelModel const& m, int16_t* const out,
+			   size_t const n, int32_t* const work,
+			   uint32_t* const overflows)
+{
+    size_t const delay = std::min<size_t>(m.delay, n);
+    uint32_t over = 0;
+
+    // Until the delay runs out, the output holds its value from
+    // before the trigger.
+
+    for (size_t ii = 0; ii < delay; ++ii)
+	out[ii] = m.initial;
+
+    size_t const len = n - delay;
+
+    rampStage(m.ramp, m.rampWords, m.rampStart, work, len);
+
+    // In sine mode the ramp sets the amplitude of a sine wave whose
+    // phase advances by `frequency` 1/65536ths of a cycle each tick.
+
+    if (m.sineMode) {
+	int16_t const* const sine = sineTable();
+	uint32_t const step = (uint32_t) m.frequency << 16;
+	uint32_t phase = (uint32_t) m.phase << 16;
+
+	for (size_t ii = 0; ii < len; ++ii, phase += step)
+	    work[ii] = (work[ii] * sine[phase >> (32 - sineBits)]) >> 15;
+    }
+
+    // Scale, offset and saturate. Results outside the DAC's range
+    // are counted as calculation overflows. The loop is free of
+    // branches so it vectorizes.
+
+    int32_t const scale = m.scale;
+    unsigned const shift = m.scaleShift;
+    int32_t const offset = m.offset;
+    int16_t* const dst = out + delay;
+
+    for (size_t ii = 0; ii < len; ++ii) {
+	int32_t const v = ((work[ii] * scale) >> shift) + offset;
+	int32_t const c = std::min(std::max(v, -32768), 32767);
+
+	over += c != v;
+	dst[ii] = (int16_t) c;
+    }
+    if (overflows)
+	*overflows = over;
+}
+
+// Fills in a channel model from the card's maps and tables for an
+// interrupt level. They're read through the configuration copy.
+
+bool Card::modelLevel(Card::LockType const& lock, Channel const& chan,
+		      uint16_t const intLvl, uint16_t* const rampBuf,
+		      ChannelModel& m)
+{
+    if (intLvl >= 32)
+	throw int16_t(ERR_BADSLOT);
+
+    bool const saved = cachedReads;
+    uint16_t ramp, scale, offset, freq, phase, mode;
+    bool okay;
+
+    cachedReads = true;
+    okay = getRampMap(lock, chan, intLvl, &ramp, 1) &&
+	getScaleFactorMap(lock, chan, intLvl, &scale, 1) &&
+	getOffsetMap(lock, chan, intLvl, &offset, 1) &&
+	getFrequencyMap(lock, chan, intLvl, &freq, 1) &&
+	getPhaseMap(lock, chan, intLvl, &phase, 1) &&
+	getDelays(lock, chan, intLvl, &m.delay, 1) &&
+	ramp < 16 && scale >= 1 && scale < 32 && offset < 32 &&
+	freq < 32 && phase < 32 &&
+	getRamp(lock, chan, ramp, 0, rampBuf, 128) &&
+	getScaleFactors(lock, chan, scale - 1, (uint16_t*) &m.scale, 1) &&
+	getOffsets(lock, chan, offset, (uint16_t*) &m.offset, 1) &&
+	getFrequencies(lock, chan, freq, &m.frequency, 1) &&
+	getPhases(lock, chan, phase, &m.phase, 1) &&
+	getSineWaveMode(lock, chan, &mode);
+    cachedReads = saved;
+
+    m.ramp = rampBuf;
+    m.rampWords = 128;
+    m.sineMode = okay && mode != 0;
+    return okay;
+}
+
+// Simulates four channels for `ms` milliseconds of output and
+// reports how long it took.
+
+STATUS v473_model_bench(int const ms)
+{
+    if (ms <= 0 || ms > 10000) {
+	printf("usage: v473_model_bench milliseconds\n");
+	return ERROR;
+    }
+
+    size_t const n = (size_t) ms * 100;
+    int16_t* const out = new int16_t[n];
+    int32_t* const work = new int32_t[n];
+    uint16_t ramp[2 * (maxSegments + 1)];
+
+    // A trapezoid that fills the simulated time.
+
+    uint16_t const quarter = (uint16_t) std::min<size_t>(n / 4, 0xffff);
+
+    ramp[0] = 30000;
+    ramp[1] = quarter;
+    ramp[2] = 30000;
+    ramp[3] = quarter;
+    ramp[4] = (uint16_t) -30000;
+    ramp[5] = quarter;
+    ramp[6] = 0;
+    ramp[7] = quarter;
+    ramp[8] = 0;
+    ramp[9] = 0;
+
+    ChannelModel m;
+
+    m.ramp = ramp;
+    m.rampWords = 10;
+    m.rampStart = 0;
+    m.initial = 0;
+    m.scale = 256;
+    m.scaleShift = 8;
+    m.offset = 0;
+    m.delay = 0;
+    m.sineMode = false;
+    m.frequency = 0;
+    m.phase = 0;
+
+    uint32_t over = 0;
+    uint32_t const t0 = timeStamp();
+
+    for (size_t chan = 0; chan < 4; ++chan) {
+	uint32_t tmp;
+
+	m.sineMode = chan == 3;
+	m.frequency = 39;	// about 60 Hz
+	simulateChannel(m, out, n, work, &tmp);
+	over += tmp;
+    }
+
+    uint32_t const usec = tbToUsec(timeStamp() - t0);
+
+    delete [] out;
+    delete [] work;
+    printf("4 channels x %d ms simulated in %u us (%u overflows)\n", ms, usec,
+	   over);
+    return OK;
+}
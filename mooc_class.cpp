@@ -1,4 +1,7 @@
 #include <vxWorks.h>
+#include <taskLib.h>
+#include <semLib.h>
+#include <sysLib.h>
 #include <cstdio>
 #include <memory>
 #include "v473.h"
@@ -16,6 +19,8 @@ typedef unsigned char type_t;
 #define	REQ_TO_TYPE(a)		OMSPDEF_TO_TYPE(*(OMSP_DEF const*) &(a)->OMSP)
 #define REQ_TO_SUBCODE(req)	((((OMSP_DEF const*)&(req)->OMSP)->chan & 0xf0) >> 4)
 #define REQ_TO_453CHAN(req)	(((OMSP_DEF const*)&(req)->OMSP)->chan & 0x3)
+#define REQ_TO_ALLCHAN(req)	(((OMSP_DEF const*)&(req)->OMSP)->chan & 0x4)
+#define REQ_TO_READBACK(req)	(((OMSP_DEF const*)&(req)->OMSP)->chan & 0x8)
 
 // for Subcode 15 only...
 
@@ -65,86 +70,465 @@ typedef bool (V473::Card::*STableWriteCallback)(V473::Card::LockType const&,
 						uint16_t, uint16_t const*,
 						uint16_t);
 
-// Reading the simple tables and the maps are done practically the
-// same way. This function encapsulates the similarities.
+// Sizes, in bytes, of the tables presented to ACNET.
+
+enum {
+    wordSize = sizeof(uint16_t),
+    segmentSize = 2 * wordSize,
+    rampSize = 64 * segmentSize,
+    rampTableSize = 15 * rampSize,
+    bankSize = 32 * wordSize,
+    mapTableSize = 5 * bankSize,
+    scaleFactorSize = 31 * wordSize,
+    versionSize = 42 * wordSize,
+    diagSize = 44 * wordSize,
+    triggerMapSize = 256 * wordSize,
+    progressSize = 4 * wordSize
+};
+
+// Every request is described by one of these after the dispatcher
+// has validated it. `lock` is null if the subcode's descriptor says
+// the handler doesn't need the card locked.
+
+struct Context {
+    V473::Card* card;
+    V473::Card::LockType const* lock;
+    size_t chan;
+    size_t offset;
+    size_t length;
+    void* data;
+};
+
+struct Subcode;
+
+typedef STATUS (*Handler)(Subcode const&, Context const&);
+
+// How a subcode uses the channel field of the SSDN.
+
+enum ChanRule {
+    crAny,			// any of the four channels
+    crOne,			// any one channel; not all-channel
+    crZero,			// card-wide property; channel must be 0
+    crIgnore			// card-wide property; channel is ignored
+};
+
+// How a subcode validates the request's length and offset.
+
+enum LenRule {
+    lrTable,			// whole entries, within `maxSize`
+    lrArray,			// like lrTable, but can't be empty
+    lrExact,			// exactly `maxSize` bytes at offset 0
+    lrAtMost			// up to `maxSize` bytes at offset 0
+};
+
+// Describes one subcode of one message type. Each message type has
+// a table of 16 of these, indexed directly by the subcode. Entries
+// with no handler are unsupported.
+
+struct Subcode {
+    Handler handler;
+    size_t entrySize;
+    size_t maxSize;
+    ChanRule chan;
+    LenRule len;
+    bool locked;
+    STableReadCallback read;
+    STableWriteCallback write;
+};
+
+// Request, error and latency counters kept for every subcode of
+// every message type. Times are in microseconds.
+
+struct SubcodeStats {
+    uint32_t requests;
+    uint32_t errors;
+    uint32_t maxTime;
+    uint64_t totalTime;
+};
+
+// Latency histograms kept for each message type: the time spent
+// waiting for the card's lock, the time the card spent processing
+// mailbox commands and the total time in the driver.
+
+struct MsgTiming {
+    V473::Histogram lockWait;
+    V473::Histogram hardware;
+    V473::Histogram total;
+};
+
+struct MsgType {
+    char const* name;
+    Subcode const* table;
+    SubcodeStats* stats;
+    MsgTiming* timing;
+    STATUS unsupported;
+    bool cached;
+};
+
+// Enables the card's cached reads for the lifetime of the object, so
+// they're turned off again if a handler throws.
+
+class CachedReads {
+    V473::Card* const card;
+    V473::Card::LockType const& lock;
+
+    CachedReads(CachedReads const&);
+    CachedReads& operator=(CachedReads const&);
+
+ public:
+    CachedReads(V473::Card* const c, V473::Card::LockType const& l,
+		bool const en) :
+	card(c), lock(l)
+    {
+	card->setCachedReads(lock, en);
+    }
+
+    ~CachedReads() { card->setCachedReads(lock, false); }
+};
+
+// Descriptors are checked when the driver is compiled: the maximum
+// size must be a non-zero, whole number of entries. A bad descriptor
+// gives a negative array size, which stops the build.
 
-static STATUS readSimpleTable(RS_REQ const* const req, size_t const entrySize,
-			      size_t const maxSize, V473::Card* const obj,
-			      STableReadCallback mt, uint16_t* const ptr)
+#define SIZE_CHECK(e, m) \
+    (sizeof(char[((e) > 0 && (m) >= (e) && (m) % (e) == 0) ? 1 : -1]) * 0)
+
+#define SUBCODE(h, e, m, c, l, k) \
+    { (h), (e), (m) + SIZE_CHECK(e, m), (c), (l), (k), 0, 0 }
+#define READ_TABLE(e, m, f) \
+    { readTable, (e), (m) + SIZE_CHECK(e, m), crAny, lrTable, true, (f), 0 }
+#define WRITE_TABLE(e, m, f) \
+    { writeTable, (e), (m) + SIZE_CHECK(e, m), crAny, lrTable, true, 0, (f) }
+
+// Checks the channel, length and offset of a request against its
+// descriptor. An all-channel request carries the four channels'
+// buffers back to back, so each quarter of it is checked.
+
+static STATUS validate(Subcode const& sc, RS_REQ const* const req)
 {
-    if (REQ_TO_453CHAN(req) >= 4)
+    size_t const nChans = REQ_TO_ALLCHAN(req) ? 4 : 1;
+    size_t const length = req->ILEN / nChans;
+    size_t const offset = req->OFFSET;
+
+    if (sc.chan == crZero && REQ_TO_453CHAN(req) != 0)
 	return ERR_BADCHN;
-    if (req->ILEN % entrySize || req->ILEN > maxSize)
-	return ERR_BADLEN;
-    if (req->OFFSET % entrySize || req->OFFSET > maxSize - entrySize)
-	return ERR_BADOFF;
-    if (req->OFFSET + req->ILEN > maxSize)
-	return ERR_BADOFLEN;
+    if (nChans > 1) {
+	if (sc.chan != crAny || REQ_TO_453CHAN(req) != 0)
+	    return ERR_BADCHN;
+	if (req->ILEN % nChans)
+	    return ERR_BADLEN;
+    }
 
-    V473::Card::LockType lock(obj, v473_lock_tmo);
+    switch (sc.len) {
+     case lrArray:
+	if (!length)
+	    return ERR_BADLEN;
+
+	// FALLTHROUGH
+
+     case lrTable:
+	if (length % sc.entrySize || length > sc.maxSize)
+	    return ERR_BADLEN;
+	if (offset % sc.entrySize || offset > sc.maxSize - sc.entrySize)
+	    return ERR_BADOFF;
+	if (offset + length > sc.maxSize)
+	    return ERR_BADOFLEN;
+	break;
+
+     case lrExact:
+	if (length != sc.maxSize)
+	    return ERR_BADLEN;
+	if (offset != 0)
+	    return ERR_BADOFF;
+	break;
+
+     case lrAtMost:
+	if (length > sc.maxSize)
+	    return ERR_BADLEN;
+	if (offset != 0)
+	    return ERR_BADOFF;
+	break;
+    }
+    return NOERR;
+}
 
-    if (!(obj->*mt)(lock, REQ_TO_453CHAN(req), req->OFFSET / entrySize,
-		    ptr, req->ILEN / entrySize))
-	return ERR_MISBOARD;
+// Calls the subcode's handler once for each channel of the request.
+// All-channel requests stop at the first channel that fails.
+
+static STATUS runHandler(Subcode const& sc, Context ctx, size_t const nChans)
+{
+    STATUS result = NOERR;
+
+    for (size_t ii = 0; ii < nChans && result == NOERR; ++ii) {
+	result = sc.handler(sc, ctx);
+	++ctx.chan;
+	ctx.data = (uint8_t*) ctx.data + ctx.length;
+    }
+    return result;
+}
+
+// Validates a request, locks the card if the subcode needs it and
+// calls the subcode's handler. The subcode's counters are updated
+// on the way out.
+
+static STATUS dispatch(MsgType const& mt, RS_REQ const* const req,
+		       void* const data, V473::Card* const obj)
+{
+    uint32_t const start = V473::timeStamp();
+    size_t const subcode = REQ_TO_SUBCODE(req);
+    Subcode const& sc = mt.table[subcode];
+    SubcodeStats& stats = mt.stats[subcode];
+    STATUS result;
+    uint32_t lockStart = 0;
+    uint32_t lockWait = 0;
+    uint32_t hardware = 0;
+    uint32_t busyStart = 0;
+    bool waiting = false;
+    bool running = false;
+
+    try {
+	if (!sc.handler)
+	    result = mt.unsupported;
+	else if (NOERR == (result = validate(sc, req))) {
+	    size_t const nChans = REQ_TO_ALLCHAN(req) ? 4 : 1;
+	    Context ctx;
+
+	    ctx.card = obj;
+	    ctx.lock = 0;
+	    ctx.chan = sc.chan == crAny || sc.chan == crOne ?
+		REQ_TO_453CHAN(req) : 0;
+	    ctx.offset = req->OFFSET;
+	    ctx.length = req->ILEN / nChans;
+	    ctx.data = data;
+
+	    if (sc.locked) {
+		lockStart = V473::timeStamp();
+		waiting = true;
+
+		V473::Card::LockType lock(obj, v473_lock_tmo);
+
+		lockWait = V473::timeStamp() - lockStart;
+		waiting = false;
+		busyStart = obj->busyTime(lock);
+		running = true;
+		ctx.lock = &lock;
+
+		// Readings come from the driver's copy of the card's
+		// configuration, unless the request asks for the
+		// hardware to be read back.
+
+		{
+		    CachedReads const cr(obj, lock,
+					 mt.cached && !REQ_TO_READBACK(req));
+
+		    result = runHandler(sc, ctx, nChans);
+		}
+		hardware = obj->busyTime(lock) - busyStart;
+		running = false;
+	    } else {
+		// Unlocked handlers lock the card for each step, so their
+		// hardware time is measured without the lock.
+
+		busyStart = obj->busyTime();
+		running = true;
+		result = runHandler(sc, ctx, nChans);
+		hardware = obj->busyTime() - busyStart;
+		running = false;
+	    }
+	}
+    }
+    catch (int16_t const& e) {
+	result = e;
+    }
+    catch (std::exception const& e) {
+	printf("%s: exception '%s'\n", mt.name, e.what());
+	result = ERR_DEVICEERROR;
+    }
+
+    // A lock that timed out still counts as time spent waiting, and
+    // a handler that threw still counts the commands it made.
+
+    if (waiting)
+	lockWait = V473::timeStamp() - lockStart;
+    if (running)
+	hardware = obj->busyTime() - busyStart;
+
+    uint32_t const elapsed = V473::tbToUsec(V473::timeStamp() - start);
+
+    ++stats.requests;
+    if (result != NOERR)
+	++stats.errors;
+    stats.totalTime += elapsed;
+    if (elapsed > stats.maxTime)
+	stats.maxTime = elapsed;
+    mt.timing->lockWait.record(V473::tbToUsec(lockWait));
+    mt.timing->hardware.record(V473::tbToUsec(hardware));
+    mt.timing->total.record(elapsed);
+    return result;
+}
+
+// Reading the simple tables and the maps are done practically the
+// same way. These handlers use the accessor named in the descriptor.
+
+static STATUS readTable(Subcode const& sc, Context const& ctx)
+{
+    return (ctx.card->*sc.read)(*ctx.lock, ctx.chan,
+				ctx.offset / sc.entrySize,
+				(uint16_t*) ctx.data,
+				ctx.length / sc.entrySize) ?
+	NOERR : ERR_MISBOARD;
+}
+
+static STATUS writeTable(Subcode const& sc, Context const& ctx)
+{
+    return (ctx.card->*sc.write)(*ctx.lock, ctx.chan,
+				 ctx.offset / sc.entrySize,
+				 (uint16_t const*) ctx.data,
+				 ctx.length / sc.entrySize) ?
+	NOERR : ERR_MISBOARD;
+}
+
+// Handler for subcodes that are accepted, but ignored.
+
+static STATUS ignoreRequest(Subcode const&, Context const&)
+{
     return NOERR;
 }
 
-static STATUS writeSimpleTable(RS_REQ const* const req, size_t const entrySize,
-			       size_t const maxSize, V473::Card* const obj,
-			       STableWriteCallback mt,
-			       uint16_t const* const ptr)
+// G(i) tables. We don't have these, so fake it.
+
+static STATUS readGiTable(Subcode const&, Context const& ctx)
 {
-    if (REQ_TO_453CHAN(req) >= 4)
-	return ERR_BADCHN;
-    if (req->ILEN % entrySize || req->ILEN > maxSize)
-	return ERR_BADLEN;
-    if (req->OFFSET % entrySize || req->OFFSET > maxSize - entrySize)
-	return ERR_BADOFF;
-    if (req->OFFSET + req->ILEN > maxSize)
-	return ERR_BADOFLEN;
+    if (ctx.data)
+	memset(ctx.data, 0, ctx.length);
+    return NOERR;
+}
 
-    V473::Card::LockType lock(obj, v473_lock_tmo);
+static STATUS readRamps(Subcode const&, Context const& ctx)
+{
+    return ctx.card->getRamp(*ctx.lock, ctx.chan, ctx.offset / rampSize + 1,
+			     (ctx.offset % rampSize) / segmentSize,
+			     (uint16_t*) ctx.data, ctx.length / wordSize) ?
+	NOERR : ERR_MISBOARD;
+}
 
-    if (!(obj->*mt)(lock, REQ_TO_453CHAN(req), req->OFFSET / entrySize,
-		    ptr, req->ILEN / entrySize))
-	return ERR_MISBOARD;
+// F(t) uploads lock the card for each ramp, rather than for the
+// whole request, so this handler is registered as unlocked. For the
+// same reason it doesn't take all-channel requests, which are made
+// under one hold of the lock.
+
+static STATUS writeRamps(Subcode const&, Context const& ctx)
+{
+    return ctx.card->uploadRamps(ctx.chan, ctx.offset / rampSize + 1,
+				 (ctx.offset % rampSize) / segmentSize,
+				 (uint16_t const*) ctx.data,
+				 ctx.length / wordSize, v473_lock_tmo) ?
+	NOERR : ERR_MISBOARD;
+}
+
+// Reports the progress of the channel's latest F(t) upload: the
+// state (0 = idle, 1 = in progress, 2 = failed), the total number
+// of words and the number written and skipped so far.
+
+static STATUS readUploadProgress(Subcode const&, Context const& ctx)
+{
+    V473::Card::UploadProgress const prog =
+	ctx.card->getUploadProgress(*ctx.lock, ctx.chan);
+    uint16_t* const ptr = (uint16_t*) ctx.data;
+
+    ptr[0] = prog.state;
+    ptr[1] = prog.total;
+    ptr[2] = prog.written;
+    ptr[3] = prog.skipped;
     return NOERR;
 }
 
-#define BUMP(l,o,p,s)	{ (l) -= (s); (o) += (s); \
-	(p) = (void*)((char*) (p) + (s)); }
+// The five maps (ramp, scale factor, offset, frequency and phase)
+// are presented as one device. A request may span several maps.
 
-static STATUS readVersionDevice(RS_REQ const* const req, void* rep,
-				V473::Card* const* const obj)
+static STATUS readMaps(Subcode const&, Context const& ctx)
 {
-    static size_t const entrySize = 2;
-    static size_t const maxSize = 42 * entrySize;
-    size_t length = req->ILEN;
-    size_t offset = req->OFFSET;
+    static STableReadCallback const mt[] = {
+	&V473::Card::getRampMap,
+	&V473::Card::getScaleFactorMap,
+	&V473::Card::getOffsetMap,
+	&V473::Card::getFrequencyMap,
+	&V473::Card::getPhaseMap
+    };
+
+    size_t length = ctx.length;
+    size_t offset = ctx.offset;
+    uint16_t* ptr = (uint16_t*) ctx.data;
+
+    for (size_t ii = 0; length > 0 && ii < mapTableSize / bankSize; ++ii)
+	if (offset < (ii + 1) * bankSize) {
+	    size_t const total(std::min(length, ((ii + 1) * bankSize) - offset));
+
+	    if (!(ctx.card->*mt[ii])(*ctx.lock, ctx.chan,
+				     (offset % bankSize) / wordSize,
+				     ptr, total / wordSize))
+		return ERR_MISBOARD;
+	    ptr += total / wordSize;
+	    offset += total;
+	    length -= total;
+	}
+    return NOERR;
+}
+
+static STATUS writeMaps(Subcode const&, Context const& ctx)
+{
+    static STableWriteCallback const mt[] = {
+	&V473::Card::setRampMap,
+	&V473::Card::setScaleFactorMap,
+	&V473::Card::setOffsetMap,
+	&V473::Card::setFrequencyMap,
+	&V473::Card::setPhaseMap
+    };
+
+    size_t length = ctx.length;
+    size_t offset = ctx.offset;
+    uint16_t const* ptr = (uint16_t const*) ctx.data;
+
+    for (size_t ii = 0; length > 0 && ii < mapTableSize / bankSize; ++ii)
+	if (offset < (ii + 1) * bankSize) {
+	    size_t const total(std::min(length, ((ii + 1) * bankSize) - offset));
+
+	    if (!(ctx.card->*mt[ii])(*ctx.lock, ctx.chan,
+				     (offset % bankSize) / wordSize,
+				     ptr, total / wordSize))
+		return ERR_MISBOARD;
+	    ptr += total / wordSize;
+	    offset += total;
+	    length -= total;
+	}
+    return NOERR;
+}
 
-    if (!length || length % entrySize || length > maxSize)
-	return ERR_BADLEN;
-    if (offset % entrySize || offset > maxSize - entrySize)
-	return ERR_BADOFF;
-    if (offset + length > maxSize)
-	return ERR_BADOFLEN;
+#define BUMP(l,o,p,s)	{ (l) -= (s); (o) += (s); \
+	(p) = (void*)((char*) (p) + (s)); }
 
-    V473::Card::LockType lock(*obj, v473_lock_tmo);
+static STATUS readVersionDevice(Subcode const&, Context const& ctx)
+{
+    V473::Card* const obj = ctx.card;
+    V473::Card::LockType const& lock = *ctx.lock;
+    size_t length = ctx.length;
+    size_t offset = ctx.offset;
+    void* rep = ctx.data;
 
     if (offset == 0) {
-	if (!(*obj)->getFirmwareVersion(lock, (uint16_t*) rep))
+	if (!obj->getFirmwareVersion(lock, (uint16_t*) rep))
 	    return ERR_MISBOARD;
 	BUMP(length, offset, rep, 2);
     }
 
     if (offset == 2 && length >= 2) {
-	if (!(*obj)->getActiveRamp(lock, (uint16_t*) rep))
+	if (!obj->getActiveRamp(lock, (uint16_t*) rep))
 	    return ERR_MISBOARD;
 	BUMP(length, offset, rep, 2);
     }
 
     if (offset == 4 && length >= 2) {
-	if (!(*obj)->getActiveScaleFactor(lock, (uint16_t*) rep))
+	if (!obj->getActiveScaleFactor(lock, (uint16_t*) rep))
 	    return ERR_MISBOARD;
 	BUMP(length, offset, rep, 2);
     }
@@ -157,7 +541,7 @@ static STATUS readVersionDevice(RS_REQ const* const req, void* rep,
     }
 
     if (offset == 14 && length >= 2) {
-	if (!(*obj)->getCurrentSegment(lock, (uint16_t*) rep))
+	if (!obj->getCurrentSegment(lock, (uint16_t*) rep))
 	    return ERR_MISBOARD;
 	BUMP(length, offset, rep, 2);
     }
@@ -170,7 +554,7 @@ static STATUS readVersionDevice(RS_REQ const* const req, void* rep,
     }
 
     if (offset == 24 && length >= 2) {
-	if (!(*obj)->getModuleId(lock, (uint16_t*) rep))
+	if (!obj->getModuleId(lock, (uint16_t*) rep))
 	    return ERR_MISBOARD;
 	BUMP(length, offset, rep, 2);
     }
@@ -183,13 +567,13 @@ static STATUS readVersionDevice(RS_REQ const* const req, void* rep,
     }
 
     if (offset == 68 && length >= 2) {
-	if (!(*obj)->getCurrentIntLvl(lock, (uint16_t*) rep))
+	if (!obj->getCurrentIntLvl(lock, (uint16_t*) rep))
 	    return ERR_MISBOARD;
 	BUMP(length, offset, rep, 2);
     }
 
     if (offset == 70 && length >= 2) {
-	if (!(*obj)->getLastTclkEvent(lock, (uint16_t*) rep))
+	if (!obj->getLastTclkEvent(lock, (uint16_t*) rep))
 	    return ERR_MISBOARD;
 	BUMP(length, offset, rep, 2);
     }
@@ -228,30 +612,20 @@ static STATUS readVersionDevice(RS_REQ const* const req, void* rep,
 // ...
 // [43]	0x423f	Interrupt level 31 count
 
-static STATUS readDiagnostics(RS_REQ const* const req, void* rep,
-			      V473::Card* const* const obj)
+static STATUS readDiagnostics(Subcode const& sc, Context const& ctx)
 {
-    static size_t const entrySize = 2;
-    static size_t const maxSize = 44 * entrySize;
-    size_t length = req->ILEN;
-    size_t offset = req->OFFSET;
-
-    if (!length || length % entrySize || length > maxSize)
-	return ERR_BADLEN;
-    if (offset % entrySize || offset > maxSize - entrySize)
-	return ERR_BADOFF;
-    if (offset + length > maxSize)
-	return ERR_BADOFLEN;
-    if (REQ_TO_453CHAN(req) >= 4)
-	return ERR_BADCHN;
-
-    V473::Card::LockType lock(*obj, v473_lock_tmo);
+    static size_t const entrySize = wordSize;
+    V473::Card* const obj = ctx.card;
+    V473::Card::LockType const& lock = *ctx.lock;
+    size_t length = ctx.length;
+    size_t offset = ctx.offset;
+    void* rep = ctx.data;
 
     if (offset == 0) {
 	if (v473_debug & 1)
 	    printf("Called V473::Card::getDAC() with offset %d, length %d.\n",
 		   offset / entrySize, length / entrySize);
-	if (!(*obj)->getDAC(lock, REQ_TO_453CHAN(req), (uint16_t*) rep))
+	if (!obj->getDAC(lock, ctx.chan, (uint16_t*) rep))
 	    return ERR_MISBOARD;
 	BUMP(length, offset, rep, 2);
     }
@@ -274,623 +648,384 @@ static STATUS readDiagnostics(RS_REQ const* const req, void* rep,
 	    printf("Called V473::Card::getDiagCounters() with offset %d, "
 		   "length %d.\n", (offset - 6) / entrySize,
 		   amount / entrySize);
-	if (!(*obj)->getDiagCounters(lock, (offset - 6) / entrySize,
-				     amount / entrySize, (uint16_t*) rep))
+	if (!obj->getDiagCounters(lock, (offset - 6) / entrySize,
+				  amount / entrySize, (uint16_t*) rep))
 	    return ERR_MISBOARD;
 	BUMP(length, offset, rep, amount);
     }
 
     if (offset >= 24 && length >= 2) {
 	size_t const amount =
-	    length > (88 - offset) ? (88 - offset) : length;
+	    length > (sc.maxSize - offset) ? (sc.maxSize - offset) : length;
 
 	if (v473_debug & 1)
 	    printf("Called V473::Card::getIntCounters() with offset %d, "
 		   "length %d.\n", (offset - 24) / entrySize,
 		   amount / entrySize);
-	if (!(*obj)->getIntCounters(lock, (offset - 24) / entrySize,
-				    (uint16_t*) rep, amount / entrySize))
+	if (!obj->getIntCounters(lock, (offset - 24) / entrySize,
+				 (uint16_t*) rep, amount / entrySize))
 	    return ERR_MISBOARD;
     }
     return NOERR;
 }
 
-static STATUS devReading(short, RS_REQ const* const req, void* const rep,
-			 V473::Card* const* const ivs)
+static STATUS readDAC(Subcode const&, Context const& ctx)
 {
-    try {
-	switch (REQ_TO_SUBCODE(req)) {
-	 case 7:
-	    return readVersionDevice(req, rep, ivs);
-
-	 case 5:
-	    return readDiagnostics(req, rep, ivs);
-
-	 case 1:		// G(i) tables. We dont have these, so fake it.
-	 case 2:		// F(t) tables.
-	 case 3:		// Delay Table
-	 case 4:		// Offset Table
-	 case 6:		// Scale Factor Table
-	 case 9:		// Frequency Table
-	 case 10:		// Phase Table
-	 default:
-	    return ERR_UNSUPMT;
-	}
-	return NOERR;
-    }
-    catch (int16_t const& e) {
-	return e;
-    }
-    catch (std::exception const& e) {
-	printf("%s: exception '%s'\n", __func__, e.what());
-	return ERR_DEVICEERROR;
-    }
+    return ctx.card->getDAC(*ctx.lock, ctx.chan, (uint16_t*) ctx.data) ?
+	NOERR : ERR_MISBOARD;
 }
 
-static STATUS devReadSetting(short, RS_REQ const* const req,
-			     void* const rep, V473::Card* const* const ivs)
+// The DAC can only be set directly when the channel isn't playing a
+// ramp.
+
+static STATUS writeDAC(Subcode const&, Context const& ctx)
 {
-    try {
-	switch (REQ_TO_SUBCODE(req)) {
-	 case 1:		// G(i) tables. We dont have these, so fake it.
-	     {
-		 static size_t const entrySize = 4;
-		 static size_t const maxSize = 15 * 64 * entrySize;
-		 size_t const length = req->ILEN;
-		 size_t const offset = req->OFFSET;
-
-		 if (REQ_TO_453CHAN(req) >= 4)
-		     return ERR_BADCHN;
-		 if (length % entrySize || length > maxSize)
-		     return ERR_BADLEN;
-		 if (offset % entrySize || offset > maxSize - entrySize)
-		     return ERR_BADOFF;
-		 if (offset + length > maxSize)
-		     return ERR_BADOFLEN;
-
-		 if (rep)
-		     memset(rep, 0, req->ILEN);
-	     }
-	     break;
-
-	 case 2:		// F(t) tables.
-	     {
-		 static size_t const entrySize = 4;
-		 static size_t const maxSize = 15 * 64 * entrySize;
-		 size_t const length = req->ILEN;
-		 size_t const offset = req->OFFSET;
-
-		 if (REQ_TO_453CHAN(req) >= 4)
-		     return ERR_BADCHN;
-		 if (length % entrySize || length > maxSize)
-		     return ERR_BADLEN;
-		 if (offset % entrySize || offset > maxSize - entrySize)
-		     return ERR_BADOFF;
-		 if (offset + length > maxSize)
-		     return ERR_BADOFLEN;
-
-		 static size_t const rampSize = 64 * entrySize;
-		 V473::Card::LockType lock(*ivs, v473_lock_tmo);
-
-		 if (!(*ivs)->getRamp(lock, REQ_TO_453CHAN(req),
-				      offset / rampSize + 1,
-				      (offset % rampSize) / 4,
-				      (uint16_t*) rep, length / 2))
-		     return ERR_MISBOARD;
-	     }
-	     break;
-
-	 case 3:		// Delay Table
-	    return readSimpleTable(req, 2, 64, *ivs,
-				   &V473::Card::getDelays,
-				   (uint16_t*) rep);
-
-	 case 4:		// Offset Table
-	    return readSimpleTable(req, 2, 64, *ivs,
-				   &V473::Card::getOffsets,
-				   (uint16_t*) rep);
-
-	 case 5:
-	     {
-		 static STableReadCallback const mt[] = {
-		     &V473::Card::getRampMap,
-		     &V473::Card::getScaleFactorMap,
-		     &V473::Card::getOffsetMap,
-		     &V473::Card::getFrequencyMap,
-		     &V473::Card::getPhaseMap
-		 };
-		 static size_t const nTables = sizeof(mt) / sizeof(*mt);
-		 static size_t const entrySize = 2;
-		 static size_t const tableSize = 32 * entrySize;
-		 static size_t const maxSize = nTables * tableSize;
-
-		 size_t length = req->ILEN;
-		 size_t offset = req->OFFSET;
-		 uint16_t* ptr = (uint16_t*) rep;
-
-		 if (REQ_TO_453CHAN(req) >= 4)
-		     return ERR_BADCHN;
-		 if (length % entrySize || length > maxSize)
-		     return ERR_BADLEN;
-		 if (offset % entrySize || offset > maxSize - entrySize)
-		     return ERR_BADOFF;
-		 if (offset + length > maxSize)
-		     return ERR_BADOFLEN;
-
-		 V473::Card::LockType lock(*ivs, v473_lock_tmo);
-
-		 for (size_t ii = 0; length > 0 && ii < nTables; ++ii)
-		     if (offset < (ii + 1) * tableSize) {
-			 size_t const total(std::min(length, ((ii + 1) * tableSize) - offset));
-
-			 if (!((*ivs)->*mt[ii])(lock, REQ_TO_453CHAN(req),
-						(offset % 64) / entrySize,
-						ptr, total / entrySize))
-			     return ERR_MISBOARD;
-			 ptr += total / entrySize;
-			 offset += total;
-			 length -= total;
-		     }
-	     }
-	     return NOERR;
-
-	 case 6:		// Scale Factor Table
-	    return readSimpleTable(req, 2, 62, *ivs,
-				   &V473::Card::getScaleFactors,
-				   (uint16_t*) rep);
-
-	 case 7:
-	    return readVersionDevice(req, rep, ivs);
-
-	 case 8:
-	     {
-		 size_t const length = req->ILEN;
-		 size_t const offset = req->OFFSET;
-		 size_t const chan = REQ_TO_453CHAN(req);
-
-		 if (chan >= 4)
-		     return ERR_BADCHN;
-		 if (length > sizeof(uint16_t))
-		     return ERR_BADLEN;
-		 if (offset != 0)
-		     return ERR_BADOFF;
-
-		 V473::Card::LockType lock(*ivs, v473_lock_tmo);
-
-		 return (*ivs)->getDAC(lock, chan, (uint16_t*) rep) ?
-		     NOERR : ERR_MISBOARD;
-	     }
-	     break;
-
-	 case 9:		// Frequency Table
-	    return readSimpleTable(req, 2, 64, *ivs,
-				   &V473::Card::getFrequencies,
-				   (uint16_t*) rep);
-
-	 case 10:		// Phase Table
-	    return readSimpleTable(req, 2, 64, *ivs,
-				   &V473::Card::getPhases,
-				   (uint16_t*) rep);
-
-	 case 11:
-	    return readSimpleTable(req, 2, 512, *ivs,
-				   &V473::Card::getTriggerMap,
-				   (uint16_t*) rep);
+    uint16_t sts;
 
-	 default:
-	    return ERR_UNSUPMT;
-	}
-	return NOERR;
-    }
-    catch (int16_t const& e) {
-	return e;
+    if (!ctx.card->getPowerSupplyStatus(*ctx.lock, ctx.chan, &sts))
+	return ERR_MISBOARD;
+    if (sts & 0x100)
+	return ERR_STACTIVE;
+    return ctx.card->setDAC(*ctx.lock, ctx.chan,
+			    *(uint16_t const*) ctx.data) ?
+	NOERR : ERR_MISBOARD;
+}
+
+// Setting the trigger map is refused if any of the new events is
+// already assigned to an interrupt level.
+
+static STATUS writeTriggerMap(Subcode const& sc, Context const& ctx)
+{
+    uint16_t curr[triggerMapSize / wordSize];
+
+    if (!ctx.card->getTriggerMap(*ctx.lock, 0, 0, curr,
+				 triggerMapSize / wordSize))
+	return ERR_MISBOARD;
+
+    for (size_t ii = 0; ii < ctx.length; ii += wordSize) {
+	uint16_t const val =
+	    *(uint16_t const*)((uint8_t const*) ctx.data + ii) & 0xff;
+
+	if (val != 0x00fe)
+	    for (size_t jj = 0; jj < triggerMapSize / wordSize; ++jj)
+		if (val == (curr[jj] & 0xff))
+		    return ERR_BADSET;
     }
-    catch (std::exception const& e) {
-	printf("%s: exception '%s'\n", __func__, e.what());
-	return ERR_DEVICEERROR;
+
+    return writeTable(sc, ctx);
+}
+
+static STATUS channelControl(Subcode const&, Context const& ctx)
+{
+    V473::Card::LockType const& lock = *ctx.lock;
+    bool result;
+
+    switch (*(uint16_t const*) ctx.data) {
+     case 1:
+	result = ctx.card->waveformEnable(lock, ctx.chan, false);
+	break;
+
+     case 2:
+	result = ctx.card->waveformEnable(lock, ctx.chan, true);
+	break;
+
+     case 3:
+	result = ctx.card->resetPowerSupply(lock, ctx.chan);
+	break;
+
+     case 10:
+	result = ctx.card->startReset(lock);
+	break;
+
+     default:
+	return ERR_WRBASCON;
     }
+    return result ? NOERR : ERR_MISBOARD;
 }
 
-static STATUS devSetting(short, RS_REQ* req, void*,
-			 V473::Card* const* const obj)
+static STATUS sineModeControl(Subcode const&, Context const& ctx)
 {
-    try {
-	switch (REQ_TO_SUBCODE(req)) {
-	 case 1:
-	     {
-		 static size_t const entrySize = 4;
-		 static size_t const maxSize = 15 * 64 * entrySize;
-		 size_t const length = req->ILEN;
-		 size_t const offset = req->OFFSET;
-
-		 if (REQ_TO_453CHAN(req) >= 4)
-		     return ERR_BADCHN;
-		 if (length % entrySize || length > maxSize)
-		     return ERR_BADLEN;
-		 if (offset % entrySize || offset > maxSize - entrySize)
-		     return ERR_BADOFF;
-		 if (offset + length > maxSize)
-		     return ERR_BADOFLEN;
-	     }
-	     return NOERR;
-
-	 case 2:		// F(t) tables.
-	     {
-		 static size_t const entrySize = 4;
-		 static size_t const maxSize = 15 * 64 * entrySize;
-		 size_t const length = req->ILEN;
-		 size_t const offset = req->OFFSET;
-
-		 if (REQ_TO_453CHAN(req) >= 4)
-		     return ERR_BADCHN;
-		 if (length % entrySize || length > maxSize)
-		     return ERR_BADLEN;
-		 if (offset % entrySize || offset > maxSize - entrySize)
-		     return ERR_BADOFF;
-		 if (offset + length > maxSize)
-		     return ERR_BADOFLEN;
-
-		 static size_t const rampSize = 64 * entrySize;
-		 V473::Card::LockType lock(*obj, v473_lock_tmo);
-
-		 if (!(*obj)->setRamp(lock, REQ_TO_453CHAN(req),
-				      offset / rampSize + 1,
-				      (offset % rampSize) / 4,
-				      (uint16_t const*) req->data,
-				      length / 2))
-		     return ERR_MISBOARD;
-	     }
-	     break;
-
-	 case 3:		// Delay Table
-	    return writeSimpleTable(req, 2, 64, *obj,
-				    &V473::Card::setDelays,
-				    (uint16_t const*) req->data);
-
-	 case 4:		// Offset Table
-	    return writeSimpleTable(req, 2, 64, *obj,
-				    &V473::Card::setOffsets,
-				    (uint16_t const*) req->data);
-
-	 case 5:
-	     {
-		 static STableWriteCallback const mt[] = {
-		     &V473::Card::setRampMap,
-		     &V473::Card::setScaleFactorMap,
-		     &V473::Card::setOffsetMap,
-		     &V473::Card::setFrequencyMap,
-		     &V473::Card::setPhaseMap
-		 };
-		 static size_t const nTables = sizeof(mt) / sizeof(*mt);
-		 static size_t const entrySize = 2;
-		 static size_t const tableSize = 32 * entrySize;
-		 static size_t const maxSize = nTables * tableSize;
-
-		 size_t length = req->ILEN;
-		 size_t offset = req->OFFSET;
-		 uint16_t const* ptr = (uint16_t const*) req->data;
-
-		 if (REQ_TO_453CHAN(req) >= 4)
-		     return ERR_BADCHN;
-		 if (length % entrySize || length > maxSize)
-		     return ERR_BADLEN;
-		 if (offset % entrySize || offset > maxSize - entrySize)
-		     return ERR_BADOFF;
-		 if (offset + length > maxSize)
-		     return ERR_BADOFLEN;
-
-		 V473::Card::LockType lock(*obj, v473_lock_tmo);
-
-		 for (size_t ii = 0; length > 0 && ii < nTables; ++ii)
-		     if (offset < (ii + 1) * tableSize) {
-			 size_t const total(std::min(length, ((ii + 1) * tableSize) - offset));
-
-			 if (!((*obj)->*mt[ii])(lock, REQ_TO_453CHAN(req),
-						(offset % 64) / entrySize,
-						ptr, total / entrySize))
-			     return ERR_MISBOARD;
-			 ptr += total / entrySize;
-			 offset += total;
-			 length -= total;
-		     }
-	     }
-	     return NOERR;
-
-	 case 6:		// Scale Factor Table
-	    return writeSimpleTable(req, 2, 62, *obj,
-				    &V473::Card::setScaleFactors,
-				    (uint16_t const*) req->data);
-
-	 case 7:
-	     {
-		 static size_t const entrySize = 2;
-		 static size_t const maxSize = 84;
-		 size_t const length = req->ILEN;
-		 size_t const offset = req->OFFSET;
-
-		 if (length % entrySize || length > maxSize)
-		     return ERR_BADLEN;
-		 if (offset % entrySize || offset > maxSize - entrySize)
-		     return ERR_BADOFF;
-		 if (offset + length > maxSize)
-		     return ERR_BADOFLEN;
-	     }
-	     return NOERR;
-
-	 case 8:
-	     {
-		 size_t const length = req->ILEN;
-		 size_t const offset = req->OFFSET;
-		 size_t const chan = REQ_TO_453CHAN(req);
-
-		 if (chan >= 4)
-		     return ERR_BADCHN;
-		 if (length > sizeof(uint16_t))
-		     return ERR_BADLEN;
-		 if (offset != 0)
-		     return ERR_BADOFF;
-
-		 uint16_t sts;
-		 V473::Card::LockType lock(*obj, v473_lock_tmo);
-
-		 if (NOERR == (*obj)->getPowerSupplyStatus(lock, chan, &sts))
-		     if (!(sts & 0x100))
-			 return (*obj)->setDAC(lock, chan, DATAS(req)) ?
-			     NOERR : ERR_MISBOARD;
-		     else
-			 return ERR_STACTIVE;
-		 else
-		     return ERR_MISBOARD;
-	     }
-	     break;
-
-	 case 9:		// Frequency Table
-	    return writeSimpleTable(req, 2, 64, *obj,
-				    &V473::Card::setFrequencies,
-				    (uint16_t const*) req->data);
-
-	 case 10:		// Phase Table
-	    return writeSimpleTable(req, 2, 64, *obj,
-				    &V473::Card::setPhases,
-				    (uint16_t const*) req->data);
-
-	 case 11:		// Trigger map
-	     {
-		 if (REQ_TO_453CHAN(req) != 0)
-		     return ERR_BADCHN;
-		 if (req->ILEN % 2 || req->ILEN > 512)
-		     return ERR_BADLEN;
-		 if (req->OFFSET % 2 || req->OFFSET > 512 - 2)
-		     return ERR_BADOFF;
-		 if (req->OFFSET + req->ILEN > 512)
-		     return ERR_BADOFLEN;
-
-		 uint16_t curr[256];
-		 V473::Card::LockType lock(*obj, v473_lock_tmo);
-
-		 if (!(*obj)->getTriggerMap(lock, 0, 0, curr, 256))
-		     return ERR_MISBOARD;
-
-		 for (size_t ii = 0; ii < req->ILEN; ii += 2) {
-		     uint16_t const val =
-			 *(uint16_t const*)((uint8_t const*)req->data + ii) & 0xff;
-
-		     if (val != 0x00fe)
-			 for (size_t jj = 0; jj < 256; ++jj)
-			     if (val == (curr[jj] & 0xff))
-				 return ERR_BADSET;
-		 }
-
-		 if (!(*obj)->setTriggerMap(lock, 0, req->OFFSET / 2,
-					    (uint16_t const*) req->data,
-					    req->ILEN / 2))
-		     return ERR_MISBOARD;
-		 return NOERR;
-	     }
+    return ctx.card->setSineWaveMode(*ctx.lock, ctx.chan,
+				     *(uint16_t const*) ctx.data) ?
+	NOERR : ERR_MISBOARD;
+}
 
-	 default:
-	    return ERR_UNSUPMT;
-	}
+static STATUS tclkControl(Subcode const&, Context const& ctx)
+{
+    uint16_t const val = *(uint16_t const*) ctx.data;
+
+    if (val != 1 && val != 2)
+	return ERR_WRBASCON;
+
+    return ctx.card->tclkTrigEnable(*ctx.lock, val == 2) ?
+	NOERR : ERR_MISBOARD;
+}
+
+static STATUS readPowerSupplyStatus(Subcode const&, Context const& ctx)
+{
+    return ctx.card->getPowerSupplyStatus(*ctx.lock, ctx.chan,
+					  (uint16_t*) ctx.data) ?
+	NOERR : ERR_MISBOARD;
+}
+
+static STATUS readIrqSource(Subcode const&, Context const& ctx)
+{
+    ((uint16_t*) ctx.data)[0] = ctx.card->getIrqSource();
+    ((uint16_t*) ctx.data)[1] = 0;
+    return NOERR;
+}
+
+static STATUS readSineMode(Subcode const&, Context const& ctx)
+{
+    return ctx.card->getSineWaveMode(*ctx.lock, ctx.chan,
+				     (uint16_t*) ctx.data) ?
+	NOERR : ERR_MISBOARD;
+}
+
+static STATUS readTclkStatus(Subcode const&, Context const& ctx)
+{
+    bool val;
+
+    if (ctx.card->getTclkInterruptEnable(*ctx.lock, &val)) {
+	*(uint16_t*) ctx.data = val;
 	return NOERR;
-    }
-    catch (int16_t const& e) {
-	return e;
-    }
-    catch (std::exception const& e) {
-	printf("%s: exception '%s'\n", __func__, e.what());
-	return ERR_DEVICEERROR;
-    }
+    } else
+	return ERR_MISBOARD;
 }
 
-static STATUS devBasicControl(short, RS_REQ const* const req, void*,
-			      V473::Card* const* const obj)
+enum { mtReading, mtReadSetting, mtSetting, mtBasicControl, mtBasicStatus,
+       mtTotal };
+
+static SubcodeStats subcodeStats[mtTotal][16];
+static MsgTiming msgTiming[mtTotal];
+
+enum {
+    histogramSize = V473::Histogram::buckets * sizeof(uint32_t),
+    timingSize = mtTotal * 3 * histogramSize
+};
+
+// Reads the driver's latency histograms. This is presented as an
+// ACNET array device of 32-bit counts, laid out as:
+//
+// [0..15]	reading: lock wait
+// [16..31]	reading: hardware (mailbox) time
+// [32..47]	reading: total time in the driver
+// [48..95]	reading of setting: same three histograms
+// [96..143]	setting
+// [144..191]	basic control
+// [192..239]	basic status
+//
+// Bucket N of a histogram counts requests that took from 2^N up to
+// 2^(N+1) microseconds (bucket 0 includes anything shorter and bucket
+// 15 includes anything longer.)
+
+static STATUS readTiming(Subcode const& sc, Context const& ctx)
 {
-    try {
-	bool result = true;
+    uint32_t* ptr = (uint32_t*) ctx.data;
+    size_t const first = ctx.offset / sc.entrySize;
+    size_t const last = first + ctx.length / sc.entrySize;
+
+    for (size_t ii = first; ii < last; ++ii) {
+	MsgTiming const& mt = msgTiming[ii / (3 * V473::Histogram::buckets)];
+	size_t const bucket = ii % V473::Histogram::buckets;
+
+	switch ((ii / V473::Histogram::buckets) % 3) {
+	 case 0:
+	    *ptr++ = mt.lockWait[bucket];
+	    break;
 
-	switch (REQ_TO_SUBCODE(req)) {
 	 case 1:
-	     {
-		 size_t const length = req->ILEN;
-		 size_t const offset = req->OFFSET;
-		 size_t const chan = REQ_TO_453CHAN(req);
-
-		 if (chan >= 4)
-		     return ERR_BADCHN;
-		 if (length != sizeof(uint16_t))
-		     return ERR_BADLEN;
-		 if (offset != 0)
-		     return ERR_BADOFF;
-
-		 V473::Card::LockType lock(*obj, v473_lock_tmo);
-
-		 switch (DATAS(req)) {
-		  case 1:
-		     result = (*obj)->waveformEnable(lock, chan, false);
-		     break;
-
-		  case 2:
-		     result = (*obj)->waveformEnable(lock, chan, true);
-		     break;
-
-		  case 3:
-		     result = (*obj)->resetPowerSupply(lock, chan);
-		     break;
-
-		  case 10:
-		     (*obj)->reset(lock);
-		     break;
-
-		  default:
-		     return ERR_WRBASCON;
-		 }
-	     }
-	     break;
-
-	 case 9:
-	 case 10:
-	     {
-		 size_t const length = req->ILEN;
-		 size_t const offset = req->OFFSET;
-		 size_t const chan = REQ_TO_453CHAN(req);
-
-		 if (chan >= 4)
-		     return ERR_BADCHN;
-		 if (length > sizeof(uint16_t))
-		     return ERR_BADLEN;
-		 if (offset != 0)
-		     return ERR_BADOFF;
-
-		 V473::Card::LockType lock(*obj, v473_lock_tmo);
-
-		 result = (*obj)->setSineWaveMode(lock, chan, DATAS(req));
-	     }
-	     break;
-
-	 case 11:
-	     {
-		 size_t const length = req->ILEN;
-		 size_t const offset = req->OFFSET;
-
-		 if (length != sizeof(uint16_t))
-		     return ERR_BADLEN;
-		 if (offset != 0)
-		     return ERR_BADOFF;
-
-		 uint16_t const val = DATAS(req);
-
-		 if (val != 1 && val != 2)
-		     return ERR_WRBASCON;
-
-		 V473::Card::LockType lock(*obj, v473_lock_tmo);
-
-		 result = (*obj)->tclkTrigEnable(lock, val == 2);
-	     }
-	     break;
+	    *ptr++ = mt.hardware[bucket];
+	    break;
 
 	 default:
-	    return ERR_WRBASCON;
+	    *ptr++ = mt.total[bucket];
+	    break;
 	}
-	return result ? NOERR : ERR_MISBOARD;
     }
-    catch (int16_t const& e) {
-	return e;
-    }
-    catch (std::exception const& e) {
-	printf("%s: exception '%s'\n", __func__, e.what());
-	return ERR_DEVICEERROR;
+    return NOERR;
+}
+
+// Clears the per-subcode counters and the latency histograms.
+
+static STATUS statsControl(Subcode const&, Context const& ctx)
+{
+    if (*(uint16_t const*) ctx.data != 1)
+	return ERR_WRBASCON;
+
+    for (size_t ii = 0; ii < mtTotal; ++ii) {
+	msgTiming[ii].lockWait.clear();
+	msgTiming[ii].hardware.clear();
+	msgTiming[ii].total.clear();
+	for (size_t sc = 0; sc < 16; ++sc) {
+	    SubcodeStats& st = subcodeStats[ii][sc];
+
+	    st.requests = st.errors = st.maxTime = 0;
+	    st.totalTime = 0;
+	}
     }
+    return NOERR;
+}
+
+// The subcode tables. Subcodes that aren't listed are unsupported.
+
+static Subcode const readingTable[16] = {
+    /*  0 */ { 0 },
+    /*  1 */ SUBCODE(readGiTable, segmentSize, rampTableSize, crAny, lrTable,
+		     false),
+    /*  2 */ SUBCODE(readRamps, segmentSize, rampTableSize, crAny, lrTable,
+		     true),
+    /*  3 */ READ_TABLE(wordSize, bankSize, &V473::Card::getDelays),
+    /*  4 */ READ_TABLE(wordSize, bankSize, &V473::Card::getOffsets),
+    /*  5 */ SUBCODE(readDiagnostics, wordSize, diagSize, crAny, lrArray, true),
+    /*  6 */ READ_TABLE(wordSize, scaleFactorSize,
+			&V473::Card::getScaleFactors),
+    /*  7 */ SUBCODE(readVersionDevice, wordSize, versionSize, crIgnore,
+		     lrArray, true),
+    /*  8 */ { 0 },
+    /*  9 */ READ_TABLE(wordSize, bankSize, &V473::Card::getFrequencies),
+    /* 10 */ READ_TABLE(wordSize, bankSize, &V473::Card::getPhases),
+    /* 11 */ SUBCODE(readUploadProgress, wordSize, progressSize, crAny,
+		     lrExact, true),
+    /* 12 */ SUBCODE(readTiming, sizeof(uint32_t), timingSize, crIgnore,
+		     lrArray, false)
+};
+
+static Subcode const readSettingTable[16] = {
+    /*  0 */ { 0 },
+    /*  1 */ SUBCODE(readGiTable, segmentSize, rampTableSize, crAny, lrTable,
+		     false),
+    /*  2 */ SUBCODE(readRamps, segmentSize, rampTableSize, crAny, lrTable,
+		     true),
+    /*  3 */ READ_TABLE(wordSize, bankSize, &V473::Card::getDelays),
+    /*  4 */ READ_TABLE(wordSize, bankSize, &V473::Card::getOffsets),
+    /*  5 */ SUBCODE(readMaps, wordSize, mapTableSize, crAny, lrTable, true),
+    /*  6 */ READ_TABLE(wordSize, scaleFactorSize,
+			&V473::Card::getScaleFactors),
+    /*  7 */ SUBCODE(readVersionDevice, wordSize, versionSize, crIgnore,
+		     lrArray, true),
+    /*  8 */ SUBCODE(readDAC, wordSize, wordSize, crAny, lrAtMost, true),
+    /*  9 */ READ_TABLE(wordSize, bankSize, &V473::Card::getFrequencies),
+    /* 10 */ READ_TABLE(wordSize, bankSize, &V473::Card::getPhases),
+    /* 11 */ READ_TABLE(wordSize, triggerMapSize, &V473::Card::getTriggerMap)
+};
+
+static Subcode const settingTable[16] = {
+    /*  0 */ { 0 },
+    /*  1 */ SUBCODE(ignoreRequest, segmentSize, rampTableSize, crAny,
+		     lrTable, false),
+    /*  2 */ SUBCODE(writeRamps, segmentSize, rampTableSize, crOne, lrTable,
+		     false),
+    /*  3 */ WRITE_TABLE(wordSize, bankSize, &V473::Card::setDelays),
+    /*  4 */ WRITE_TABLE(wordSize, bankSize, &V473::Card::setOffsets),
+    /*  5 */ SUBCODE(writeMaps, wordSize, mapTableSize, crAny, lrTable, true),
+    /*  6 */ WRITE_TABLE(wordSize, scaleFactorSize,
+			 &V473::Card::setScaleFactors),
+    /*  7 */ SUBCODE(ignoreRequest, wordSize, versionSize, crIgnore, lrTable,
+		     false),
+    /*  8 */ SUBCODE(writeDAC, wordSize, wordSize, crAny, lrAtMost, true),
+    /*  9 */ WRITE_TABLE(wordSize, bankSize, &V473::Card::setFrequencies),
+    /* 10 */ WRITE_TABLE(wordSize, bankSize, &V473::Card::setPhases),
+    /* 11 */ { writeTriggerMap, wordSize,
+	       triggerMapSize + SIZE_CHECK(wordSize, triggerMapSize),
+	       crZero, lrTable, true, 0, &V473::Card::setTriggerMap }
+};
+
+static Subcode const basicControlTable[16] = {
+    /*  0 */ { 0 },
+    /*  1 */ SUBCODE(channelControl, wordSize, wordSize, crAny, lrExact, true),
+    /*  2 */ { 0 },
+    /*  3 */ { 0 },
+    /*  4 */ { 0 },
+    /*  5 */ { 0 },
+    /*  6 */ { 0 },
+    /*  7 */ { 0 },
+    /*  8 */ { 0 },
+    /*  9 */ SUBCODE(sineModeControl, wordSize, wordSize, crAny, lrAtMost,
+		     true),
+    /* 10 */ SUBCODE(sineModeControl, wordSize, wordSize, crAny, lrAtMost,
+		     true),
+    /* 11 */ SUBCODE(tclkControl, wordSize, wordSize, crIgnore, lrExact, true),
+    /* 12 */ SUBCODE(statsControl, wordSize, wordSize, crIgnore, lrExact,
+		     false)
+};
+
+static Subcode const basicStatusTable[16] = {
+    /*  0 */ { 0 },
+    /*  1 */ SUBCODE(readPowerSupplyStatus, wordSize, wordSize, crAny,
+		     lrExact, true),
+    /*  2 */ { 0 },
+    /*  3 */ { 0 },
+    /*  4 */ { 0 },
+    /*  5 */ { 0 },
+    /*  6 */ { 0 },
+    /*  7 */ { 0 },
+    /*  8 */ SUBCODE(readIrqSource, 2 * wordSize, 2 * wordSize, crIgnore,
+		     lrExact, false),
+    /*  9 */ SUBCODE(readSineMode, wordSize, wordSize, crAny, lrAtMost, true),
+    /* 10 */ SUBCODE(readSineMode, wordSize, wordSize, crAny, lrAtMost, true),
+    /* 11 */ SUBCODE(readTclkStatus, wordSize, wordSize, crIgnore, lrExact,
+		     true)
+};
+
+static MsgType const msgTypes[mtTotal] = {
+    { "reading", readingTable, subcodeStats[mtReading],
+      msgTiming + mtReading, ERR_UNSUPMT, true },
+    { "setting read", readSettingTable, subcodeStats[mtReadSetting],
+      msgTiming + mtReadSetting, ERR_UNSUPMT, false },
+    { "setting", settingTable, subcodeStats[mtSetting],
+      msgTiming + mtSetting, ERR_UNSUPMT, false },
+    { "basic control", basicControlTable, subcodeStats[mtBasicControl],
+      msgTiming + mtBasicControl, ERR_WRBASCON, false },
+    { "basic status", basicStatusTable, subcodeStats[mtBasicStatus],
+      msgTiming + mtBasicStatus, ERR_UNSUPMT, false }
+};
+
+static STATUS devReading(short, RS_REQ const* const req, void* const rep,
+			 V473::Card* const* const ivs)
+{
+    return dispatch(msgTypes[mtReading], req, rep, *ivs);
+}
+
+static STATUS devReadSetting(short, RS_REQ const* const req,
+			     void* const rep, V473::Card* const* const ivs)
+{
+    return dispatch(msgTypes[mtReadSetting], req, rep, *ivs);
+}
+
+static STATUS devSetting(short, RS_REQ* req, void*,
+			 V473::Card* const* const obj)
+{
+    return dispatch(msgTypes[mtSetting], req, req->data, *obj);
+}
+
+static STATUS devBasicControl(short, RS_REQ const* const req, void*,
+			      V473::Card* const* const obj)
+{
+    return dispatch(msgTypes[mtBasicControl], req, (void*) req->data, *obj);
 }
 
 static STATUS devBasicStatus(short, RS_REQ const* const req, void* const rep,
 			     V473::Card* const* const obj)
 {
-    size_t const length = req->ILEN;
-    size_t const offset = req->OFFSET;
+    return dispatch(msgTypes[mtBasicStatus], req, rep, *obj);
+}
 
-    try {
-	switch (REQ_TO_SUBCODE(req)) {
-	 case 1:
-	     {
-		 size_t const chan = REQ_TO_453CHAN(req);
-
-		 if (chan >= 4)
-		     return ERR_BADCHN;
-		 if (length != sizeof(uint16_t))
-		     return ERR_BADLEN;
-		 if (offset != 0)
-		     return ERR_BADOFF;
-
-		 V473::Card::LockType lock(*obj, v473_lock_tmo);
-
-		 return (*obj)->getPowerSupplyStatus(lock, chan,
-						     (uint16_t*) rep) ?
-		     NOERR : ERR_MISBOARD;
-	     }
-	     break;
-
-	 case 8:
-	     {
-		 if (length != 2 * sizeof(uint16_t))
-		     return ERR_BADLEN;
-		 if (offset != 0)
-		     return ERR_BADOFF;
-
-		 ((uint16_t*)rep)[0] = (*obj)->getIrqSource();
-		 ((uint16_t*)rep)[1] = 0;
-		 return NOERR;
-	     }
-	     break;
-
-	 case 9:
-	 case 10:
-	     {
-		 size_t const chan = REQ_TO_453CHAN(req);
-
-		 if (chan >= 4)
-		     return ERR_BADCHN;
-		 if (length > sizeof(uint16_t))
-		     return ERR_BADLEN;
-		 if (offset != 0)
-		     return ERR_BADOFF;
-
-		 V473::Card::LockType lock(*obj, v473_lock_tmo);
-
-		 return (*obj)->getSineWaveMode(lock, chan, (uint16_t*) rep) ?
-		     NOERR : ERR_MISBOARD;
-	     }
-	     break;
-
-	 case 11:
-	     {
-		 if (length != sizeof(uint16_t))
-		     return ERR_BADLEN;
-		 if (offset != 0)
-		     return ERR_BADOFF;
-
-		 V473::Card::LockType lock(*obj, v473_lock_tmo);
-		 bool val;
-
-		 if ((*obj)->getTclkInterruptEnable(lock, &val)) {
-		     *(uint16_t*)rep = val;
-		     return NOERR;
-		 } else
-		     return ERR_MISBOARD;
-	     }
-	     break;
+// Displays the counters of every subcode that has seen traffic.
 
-	 default:
-	    return ERR_UNSUPMT;
+STATUS v473_subcode_stats()
+{
+    printf("MESSAGE        SUBCODE  REQUESTS    ERRORS   AVG(us)   MAX(us)\n");
+    for (size_t ii = 0; ii < mtTotal; ++ii)
+	for (size_t sc = 0; sc < 16; ++sc) {
+	    SubcodeStats const& st = msgTypes[ii].stats[sc];
+
+	    if (st.requests)
+		printf("%-14s %7u %9u %9u %9u %9u\n", msgTypes[ii].name, sc,
+		       st.requests, st.errors,
+		       (uint32_t) (st.totalTime / st.requests), st.maxTime);
 	}
-	return NOERR;
-    }
-    catch (int16_t const& e) {
-	return e;
-    }
-    catch (std::exception const& e) {
-	printf("%s: exception '%s'\n", __func__, e.what());
-	return ERR_DEVICEERROR;
-    }
+    return OK;
 }
 
 // Creates an instance of the MOOC V473 class.
@@ -910,6 +1045,7 @@ STATUS v473_create_mooc_instance(unsigned short const oid,
 	if (ptr.get()) {
 	    if (create_instance(oid, cls, ptr.get(), "V473") != NOERR)
 		throw std::runtime_error("problem creating an instance");
+	    V473::setCardOid(ptr.get(), oid);
 	    // instance_is_reentrant(oid);
 	    printf("New instance of V473 created. Underlying object @ %p.\n",
 		   ptr.release());
@@ -922,6 +1058,120 @@ STATUS v473_create_mooc_instance(unsigned short const oid,
     }
 }
 
+// Instances registered with v473_add_mooc_instance() aren't created
+// until v473_probe_mooc_instances() is called. Each card is then
+// probed by its own task, so the time it takes to boot is set by the
+// slowest card instead of the sum of all of them.
+
+namespace {
+    struct PendingInstance {
+	unsigned short oid;
+	uint8_t addr;
+	uint8_t vec;
+	V473::Card* card;
+	SEM_ID done;
+    };
+
+    PendingInstance pending[V473::maxCards];
+    size_t nPending = 0;
+};
+
+STATUS v473_add_mooc_instance(unsigned short const oid, uint8_t const addr,
+			      uint8_t const intVec)
+{
+    if (nPending >= V473::maxCards) {
+	printf("ERROR: too many V473 instances.\n");
+	return ERROR;
+    }
+
+    for (size_t ii = 0; ii < nPending; ++ii)
+	if (pending[ii].oid == oid || pending[ii].addr == addr ||
+	    pending[ii].vec == intVec) {
+	    printf("ERROR: OID, address or vector is already in use.\n");
+	    return ERROR;
+	}
+
+    PendingInstance& pi = pending[nPending++];
+
+    pi.oid = oid;
+    pi.addr = addr;
+    pi.vec = intVec;
+    pi.card = 0;
+    pi.done = 0;
+    return OK;
+}
+
+static int probeTask(PendingInstance* const pi)
+{
+    pi->card = v473_create(pi->addr, pi->vec);
+    semGive(pi->done);
+    return OK;
+}
+
+STATUS v473_probe_mooc_instances()
+{
+    short const cls = find_class("V473");
+
+    if (cls == -1) {
+	printf("ERROR: V473 class is not registered with MOOC\n");
+	return ERROR;
+    }
+
+    SEM_ID const done = semCCreate(SEM_Q_FIFO, 0);
+
+    if (!done) {
+	printf("ERROR: couldn't create semaphore\n");
+	return ERROR;
+    }
+
+    int pri = 100;
+    size_t started = 0;
+    uint32_t const start = V473::timeStamp();
+
+    taskPriorityGet(taskIdSelf(), &pri);
+    for (size_t ii = 0; ii < nPending; ++ii) {
+	pending[ii].done = done;
+	if (ERROR != taskSpawn((char*) "tV473Probe", pri, VX_FP_TASK, 8192,
+			       (FUNCPTR) probeTask, (int) (pending + ii),
+			       0, 0, 0, 0, 0, 0, 0, 0, 0))
+	    ++started;
+	else
+	    printf("ERROR: couldn't start probe of card at 0x%02x\n",
+		   pending[ii].addr);
+    }
+
+    // Every wait done while probing a card is bounded, so each task
+    // is guaranteed to report back.
+
+    for (size_t ii = 0; ii < started; ++ii)
+	semTake(done, WAIT_FOREVER);
+    semDelete(done);
+
+    uint32_t const total = V473::tbToUsec(V473::timeStamp() - start);
+    STATUS result = OK;
+
+    for (size_t ii = 0; ii < nPending; ++ii) {
+	PendingInstance const& pi = pending[ii];
+
+	if (!pi.card) {
+	    printf("OID %u: no V473 at address 0x%02x\n", pi.oid, pi.addr);
+	    result = ERROR;
+	} else if (create_instance(pi.oid, cls, pi.card, "V473") != NOERR) {
+	    printf("OID %u: problem creating an instance\n", pi.oid);
+	    v473_destroy(pi.card);
+	    result = ERROR;
+	} else {
+	    V473::setCardOid(pi.card, pi.oid);
+	    printf("OID %u: V473 at address 0x%02x probed in %u usec. "
+		   "Underlying object @ %p.\n", pi.oid, pi.addr,
+		   pi.card->getStatistics().probeTime, pi.card);
+	}
+    }
+    printf("Probed %u V473(s) in %u usec.\n", nPending, total);
+    nPending = 0;
+    return result;
+}
+
 // Creates the MOOC class for the V473. Instances of V473::Card
 // objects can be attached to instances of this MOOC class.
 
@@ -0,0 +1,188 @@
+#include "v473.h"
+#include <algorithm>
+
+using namespace V473;
+
+static uint16_t const none = 0xffff;
+
+static uint16_t findRoot(uint16_t* const parent, uint16_t v)
+{
+    while (parent[v] != v)
+	v = parent[v] = parent[parent[v]];
+    return v;
+}
+
+// Every edge has to be drawn, so the only freedom is in how the
+// edges are grouped into trails; each trail after the first costs a
+// jump. A connected component with `k` odd vertices needs at least
+// max(1, k / 2) trails. Those are found by adding a virtual edge
+// between pairs of odd vertices, and from each component to the
+// next, which leaves every vertex even and the graph connected, so
+// it has an Euler circuit (Hierholzer's algorithm.) Cutting the
+// circuit at the virtual edges leaves the trails, and the virtual
+// edges become the jumps.
+
+size_t V473::planPath(VectorDisplay::Edge const* const edge,
+		      size_t const edges, size_t const vertices,
+		      PathStep* const steps)
+{
+    if (vertices >= none)
+	throw std::logic_error("too many vertices to plan a path");
+    if (edges >= none / 4)
+	throw std::logic_error("too many edges to plan a path");
+    for (size_t ii = 0; ii < edges; ++ii)
+	if (edge[ii].from >= vertices || edge[ii].to >= vertices)
+	    throw std::logic_error("edge refers to a missing vertex");
+    if (!edges)
+	return 0;
+
+    // One block holds the scratch arrays. Virtual edges, at most one
+    // per real edge, follow the real ones.
+
+    size_t const maxEdges = 2 * edges;
+    uint16_t* const block = new uint16_t[8 * vertices + 6 * maxEdges + 3];
+    uint16_t* const parent = block;
+    uint16_t* const degree = parent + vertices;
+    uint16_t* const start = degree + vertices;
+    uint16_t* const in = start + vertices;
+    uint16_t* const out = in + vertices;
+    uint16_t* const pend = out + vertices;
+    uint16_t* const next = pend + vertices;
+    uint16_t* const from = next + vertices;
+    uint16_t* const to = from + maxEdges;
+    uint16_t* const first = to + maxEdges;
+    uint16_t* const adj = first + vertices + 1;
+    uint16_t* const stackV = adj + 2 * maxEdges;
+    uint16_t* const stackE = stackV + maxEdges + 1;
+
+    for (size_t ii = 0; ii < vertices; ++ii) {
+	parent[ii] = (uint16_t) ii;
+	degree[ii] = 0;
+	start[ii] = in[ii] = out[ii] = pend[ii] = none;
+    }
+    for (size_t ii = 0; ii < edges; ++ii) {
+	from[ii] = edge[ii].from;
+	to[ii] = edge[ii].to;
+	++degree[from[ii]];
+	++degree[to[ii]];
+	parent[findRoot(parent, from[ii])] = findRoot(parent, to[ii]);
+    }
+
+    // Each component is entered and left at odd vertices, if it has
+    // any, and its other odd vertices are paired up. The components
+    // are listed, through `next`, in order of their first vertex.
+
+    size_t total = edges;
+    uint16_t head = none;
+    uint16_t tail = none;
+
+    for (size_t ii = 0; ii < vertices; ++ii) {
+	if (!degree[ii])
+	    continue;
+
+	uint16_t const v = (uint16_t) ii;
+	uint16_t const r = findRoot(parent, v);
+
+	if (start[r] == none) {
+	    start[r] = v;
+	    next[r] = none;
+	    if (tail == none)
+		head = r;
+	    else
+		next[tail] = r;
+	    tail = r;
+	}
+	if (degree[v] & 1) {
+	    if (in[r] == none)
+		in[r] = v;
+	    else if (out[r] == none)
+		out[r] = v;
+	    else if (pend[r] == none)
+		pend[r] = v;
+	    else {
+		from[total] = pend[r];
+		to[total] = v;
+		++total;
+		pend[r] = none;
+	    }
+	}
+    }
+
+    // A component without odd vertices is entered and left at its
+    // first vertex.
+
+    for (uint16_t r = head; r != none; r = next[r])
+	if (in[r] == none)
+	    in[r] = out[r] = start[r];
+    for (uint16_t r = head; r != none; r = next[r]) {
+	from[total] = out[r];
+	to[total] = in[next[r] == none ? head : next[r]];
+	++total;
+    }
+
+    // Adjacency lists, by counting sort on the endpoints.
+
+    for (size_t ii = 0; ii <= vertices; ++ii)
+	first[ii] = 0;
+    for (size_t ii = 0; ii < total; ++ii) {
+	++first[from[ii] + 1];
+	++first[to[ii] + 1];
+    }
+    for (size_t ii = 0; ii < vertices; ++ii)
+	first[ii + 1] += first[ii];
+    for (size_t ii = 0; ii < total; ++ii) {
+	adj[first[from[ii]]++] = (uint16_t) ii;
+	adj[first[to[ii]]++] = (uint16_t) ii;
+    }
+    for (size_t ii = vertices; ii > 0; --ii)
+	first[ii] = first[ii - 1];
+    first[0] = 0;
+
+    // Hierholzer's algorithm. `first` becomes each vertex's next
+    // unexamined adjacency entry and `degree` its end. A used edge
+    // has its `from` set to `none`. The circuit comes out backwards,
+    // as (vertex, edge that reached it) pairs, into the steps.
+
+    for (size_t ii = 0; ii < vertices; ++ii)
+	degree[ii] = first[ii + 1];
+
+    size_t depth = 0;
+    size_t n = 0;
+
+    stackV[depth] = in[head];
+    stackE[depth++] = none;
+    while (depth) {
+	uint16_t const v = stackV[depth - 1];
+
+	while (first[v] < degree[v] && from[adj[first[v]]] == none)
+	    ++first[v];
+	if (first[v] < degree[v]) {
+	    uint16_t const e = adj[first[v]++];
+	    uint16_t const w = from[e] == v ? to[e] : from[e];
+
+	    from[e] = none;
+	    stackV[depth] = w;
+	    stackE[depth++] = e;
+	} else {
+	    --depth;
+	    if (stackE[depth] != none) {
+		steps[n].vertex = v;
+		steps[n].draw = stackE[depth] < edges;
+		++n;
+	    }
+	}
+    }
+
+    // Reverse the circuit and rotate it to start just after a jump.
+
+    for (size_t ii = 0; ii < n / 2; ++ii)
+	std::swap(steps[ii], steps[n - 1 - ii]);
+
+    size_t cut = 0;
+
+    while (steps[cut].draw)
+	++cut;
+    std::rotate(steps, steps + cut, steps + n);
+    delete [] block;
+    return n;
+}
@@ -0,0 +1,228 @@
+#include "v473.h"
+#include <cmath>
+#include <cstdio>
+
+using namespace V473;
+
+// Time (in ticks) of sample `idx`, rounded to the tick the card can
+// use. Rounding the absolute time, rather than each segment's
+// length, keeps the rounding errors from adding up.
+
+static long tickOf(size_t const idx, float const tps)
+{
+    return lroundf(idx * tps);
+}
+
+static int16_t toCounts(float const v)
+{
+    return (int16_t) lroundf(std::min(std::max(v, -32768.f), 32767.f));
+}
+
+// Fits the samples with the "swing door" method: starting from an
+// anchor point, each new sample narrows the range of slopes that
+// keep every sample so far within the error. When the range becomes
+// empty, the segment ends at the last sample that fit, on the slope
+// closest to that sample, and the end becomes the next anchor. It
+// makes one pass over the samples and is greedy, so it finds few
+// segments, though not always the fewest.
+
+size_t V473::compileRamp(float const* const samples, size_t const n,
+			 float const rate, float const maxError,
+			 int16_t const start, uint16_t* const ramp,
+			 size_t const budget, RampMetrics* const metrics)
+{
+    if (!n || rate <= 0.f || budget > maxSegments)
+	throw std::logic_error("bad ramp compiler arguments");
+
+    float const tps = ticksPerSecond / rate;
+
+    // The segment values are rounded to whole counts, which can add
+    // half a count of error, so the fit uses a tighter bound.
+
+    float const err = maxError > 1.f ? maxError - 0.5f : maxError * 0.5f;
+    size_t segs = 0;
+    size_t anchor = 0;
+    float va = start;
+    long lead = 0;
+
+    // If the ramp doesn't start near the first sample, jump to it.
+    // The jump takes a tick, which comes out of the first fitted
+    // segment so the later breakpoints stay on time.
+
+    if (std::fabs(samples[0] - va) > err) {
+	va = samples[0];
+	ramp[0] = (uint16_t) toCounts(va);
+	ramp[1] = 1;
+	++segs;
+	lead = 1;
+    }
+
+    while (anchor + 1 < n) {
+	float const ta = anchor * tps;
+	long const tickA = tickOf(anchor, tps);
+	float lo = -HUGE_VALF;
+	float hi = HUGE_VALF;
+	size_t end = anchor;
+
+	for (size_t jj = anchor + 1; jj < n; ++jj) {
+	    float const dt = jj * tps - ta;
+	    float const l = std::max(lo, (samples[jj] - err - va) / dt);
+	    float const h = std::min(hi, (samples[jj] + err - va) / dt);
+
+	    if (l > h || tickOf(jj, tps) - tickA - lead > 0xffff)
+		break;
+	    lo = l;
+	    hi = h;
+	    end = jj;
+	}
+
+	// Segments must be at least one tick long. At sample rates
+	// above 100 kHz, stretch the segment to the next tick. The
+	// samples it then covers aren't checked against the error,
+	// since no shorter segment could follow them.
+
+	while (end + 1 < n && tickOf(end, tps) - tickA <= lead)
+	    ++end;
+	if (end == anchor)
+	    end = anchor + 1;
+
+	float const dt = end * tps - ta;
+	float const m = std::min(std::max((samples[end] - va) / dt, lo), hi);
+	long const ticks = std::max(1L, tickOf(end, tps) - tickA - lead);
+
+	if (segs >= budget)
+	    return 0;
+
+	va += m * dt;
+	ramp[segs * 2] = (uint16_t) toCounts(va);
+	ramp[segs * 2 + 1] = (uint16_t) std::min(ticks, 0xffffL);
+	++segs;
+	anchor = end;
+	lead = 0;
+    }
+
+    if (!segs) {
+	ramp[0] = (uint16_t) toCounts(va);
+	ramp[1] = 1;
+	++segs;
+    }
+
+    // Terminate the ramp by holding the last value.
+
+    ramp[segs * 2] = ramp[segs * 2 - 2];
+    ramp[segs * 2 + 1] = 0;
+
+    if (metrics)
+	evaluateRamp(ramp, samples, n, rate, start, *metrics);
+    return (segs + 1) * 2;
+}
+
+// Finds, by bisection, about the smallest error that lets the
+// samples fit in `budget` segments.
+
+size_t V473::compileRampBudget(float const* const samples, size_t const n,
+			       float const rate, size_t const budget,
+			       int16_t const start, uint16_t* const ramp,
+			       RampMetrics* const metrics)
+{
+    float lo = 0.f;
+    float hi = 65536.f;
+    size_t words = compileRamp(samples, n, rate, hi, start, ramp, budget, 0);
+
+    if (!words)
+	return 0;
+
+    for (size_t ii = 0; ii < 20 && hi - lo > 0.5f; ++ii) {
+	float const mid = (lo + hi) * 0.5f;
+
+	if (compileRamp(samples, n, rate, mid, start, ramp, budget, 0))
+	    hi = mid;
+	else
+	    lo = mid;
+    }
+
+    words = compileRamp(samples, n, rate, hi, start, ramp, budget, metrics);
+    return words;
+}
+
+// Compares the output of a ramp, at the sample times, with the
+// samples.
+
+void V473::evaluateRamp(uint16_t const* const ramp, float const* const samples,
+			size_t const n, float const rate, int16_t const start,
+			RampMetrics& metrics)
+{
+    float const tps = ticksPerSecond / rate;
+    float const spt = rate / ticksPerSecond;
+    float maxErr = 0.f;
+    float sumSq = 0.f;
+    float prev = start;
+    long t0 = 0;
+    size_t jj = 0;
+    size_t segs = 0;
+
+    for (; segs <= maxSegments && ramp[segs * 2 + 1]; ++segs) {
+	float const target = (int16_t) ramp[segs * 2];
+	long const t1 = t0 + ramp[segs * 2 + 1];
+	size_t const last = std::min(n, (size_t) std::ceil(t1 * spt));
+	float const slope = (target - prev) / (t1 - t0);
+	float const base = prev - slope * t0;
+
+	for (; jj < last; ++jj) {
+	    float const e = samples[jj] - (base + slope * (jj * tps));
+
+	    maxErr = std::max(maxErr, std::fabs(e));
+	    sumSq += e * e;
+	}
+	prev = target;
+	t0 = t1;
+    }
+
+    // After the ramp ends, the output holds the last value.
+
+    for (; jj < n; ++jj) {
+	float const e = samples[jj] - prev;
+
+	maxErr = std::max(maxErr, std::fabs(e));
+	sumSq += e * e;
+    }
+
+    metrics.segments = segs;
+    metrics.maxError = maxErr;
+    metrics.rmsError = std::sqrt(sumSq / n);
+}
+
+// Compiles a sampled sine wave, of one period, and reports the time
+// taken and the quality of the fit.
+
+STATUS v473_ramp_compile_bench(int const n, int const maxErr)
+{
+    if (n <= 1 || n > 100000 || maxErr < 0) {
+	printf("usage: v473_ramp_compile_bench samples, error\n");
+	return ERROR;
+    }
+
+    float* const samples = new float[n];
+
+    for (int ii = 0; ii < n; ++ii)
+	samples[ii] = 30000.f * std::sin(ii * 6.2831853f / n);
+
+    uint16_t ramp[2 * (maxSegments + 1)];
+    RampMetrics m;
+    uint32_t const t0 = timeStamp();
+    size_t const words =
+	maxErr ? compileRamp(samples, n, ticksPerSecond, maxErr, 0, ramp,
+			     maxSegments, &m) :
+	compileRampBudget(samples, n, ticksPerSecond, maxSegments, 0, ramp,
+			  &m);
+    uint32_t const usec = tbToUsec(timeStamp() - t0);
+
+    delete [] samples;
+    if (!words) {
+	printf("%d samples don't fit in %u segments.\n", n, maxSegments);
+	return ERROR;
+    }
+    printf("%d samples -> %u segments in %u us, max error %.2f, "
+	   "rms error %.2f\n", n, m.segments, usec, m.maxError, m.rmsError);
+    return OK;
+}
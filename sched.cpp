@@ -0,0 +1,265 @@
+#include "v473.h"
+#include <tickLib.h>
+#include <sysLib.h>
+#include <cstdio>
+
+extern "C" UINT16 sysIn16(UINT16*);
+
+extern int v473_lock_tmo;
+
+using namespace V473;
+
+// A deferred write is made after waiting this many milliseconds, even
+// if its channel never stops playing.
+
+int v473_write_max_defer_ms = 1000;
+
+// Reads the active segment and the time remaining in it, which are
+// adjacent in the channel's memory map, with one command.
+
+bool Card::readActivity(Card::LockType const& lock, Channel const& chan,
+			Card::ChannelActivity& act)
+{
+    if (readProperty(lock, GEN_ADDR(chan, cpActiveRampTableSegment), 2)) {
+	act.segment = sysIn16(dataBuffer);
+	act.timeRemaining = sysIn16(dataBuffer + 1);
+	return true;
+    } else
+	return false;
+}
+
+// Writes a queued write with writeBank(), splitting its address back
+// into a bank and an index: ramps are 128 word banks, the tables 32
+// word banks and the trigger map is one bank, on channel 0.
+
+bool Card::issueWrite(Card::LockType const& lock, Card::QueuedWrite const& w)
+{
+    if (w.addr >= cpTriggerMap)
+	return writeBank(lock, 0, cpTriggerMap, w.addr - cpTriggerMap, w.data,
+			 w.n);
+
+    size_t const off = w.addr & 0xfff;
+    size_t const mask = off < cpRampMap ? 0x7f : 0x1f;
+
+    return writeBank(lock, w.addr >> 12, ChannelProperty(off & ~mask),
+		     (uint16_t) (off & mask), w.data, w.n);
+}
+
+// Brings the queue up to date with a newer write of `n` words at card
+// address `addr`. Queued writes it covers are dropped and those it
+// overlaps at one end are trimmed. If it lies inside a queued write,
+// its words are copied into that write and true is returned.
+
+bool Card::supersedeQueued(uint16_t const addr, uint16_t const* const ptr,
+			   uint16_t const n)
+{
+    size_t const end = addr + n;
+    size_t kept = 0;
+    bool merged = false;
+
+    for (size_t ii = 0; ii < queuedWrites; ++ii) {
+	QueuedWrite& w = writeQueue[ii];
+	size_t const wEnd = w.addr + w.n;
+	bool keep = true;
+
+	if (addr < wEnd && w.addr < end) {
+	    if (addr <= w.addr && wEnd <= end)
+		keep = false;
+	    else if (addr > w.addr && end < wEnd) {
+		for (size_t jj = 0; jj < n; ++jj)
+		    w.data[addr - w.addr + jj] = ptr[jj];
+		merged = true;
+	    } else if (addr <= w.addr) {
+		size_t const cut = end - w.addr;
+
+		for (size_t jj = cut; jj < w.n; ++jj)
+		    w.data[jj - cut] = w.data[jj];
+		w.addr = (uint16_t) end;
+		w.n = (uint16_t) (w.n - cut);
+	    } else
+		w.n = (uint16_t) (addr - w.addr);
+	}
+	if (keep) {
+	    if (kept != ii)
+		writeQueue[kept] = w;
+	    ++kept;
+	}
+    }
+    queuedWrites = kept;
+    return merged;
+}
+
+// The newest write goes to the end of the queue, after the older
+// writes it overlapped have been dropped or trimmed, so it wins
+// whatever order the queue is flushed in.
+
+bool Card::queueWrite(Card::LockType const&, uint16_t const chan,
+		      uint16_t const addr, uint16_t const* const ptr,
+		      uint16_t const n)
+{
+    if (n > 128)
+	throw std::logic_error("deferred write longer than 128 words");
+
+    if (!supersedeQueued(addr, ptr, n)) {
+	if (queuedWrites >= maxQueuedWrites)
+	    return false;
+
+	QueuedWrite& w = writeQueue[queuedWrites];
+
+	w.chan = chan;
+	w.addr = addr;
+	w.n = n;
+	w.queued = tickGet();
+	for (size_t ii = 0; ii < n; ++ii)
+	    w.data[ii] = ptr[ii];
+	++queuedWrites;
+    }
+    startTclkWatcher();
+    return true;
+}
+
+// If the queue is full the write is made right away, as if urgent.
+
+bool Card::deferTable(Card::LockType const& lock, Card::TableWriter const func,
+		      Channel const& chan, uint16_t const start,
+		      uint16_t const* const ptr, uint16_t const n,
+		      bool const urgent)
+{
+    // The table each writer writes, and the index of its first
+    // entry.
+
+    static struct {
+	TableWriter func;
+	ChannelProperty prop;
+	uint16_t bias;
+    } const table[] = {
+	{ &Card::setDelays, cpDelays, 0 },
+	{ &Card::setFrequencies, cpFrequencies, 0 },
+	{ &Card::setFrequencyMap, cpFrequencyMap, 0 },
+	{ &Card::setOffsetMap, cpOffsetMap, 0 },
+	{ &Card::setOffsets, cpOffsets, 0 },
+	{ &Card::setPhaseMap, cpPhaseMap, 0 },
+	{ &Card::setPhases, cpPhases, 0 },
+	{ &Card::setRampMap, cpRampMap, 0 },
+	{ &Card::setScaleFactorMap, cpScaleFactorMap, 0 },
+	{ &Card::setScaleFactors, cpScaleFactors, 1 },
+	{ &Card::setTriggerMap, cpTriggerMap, 0 }
+    };
+
+    if (!urgent)
+	for (size_t ii = 0; ii < sizeof(table) / sizeof(*table); ++ii)
+	    if (table[ii].func == func) {
+		ChannelProperty const prop = table[ii].prop;
+		bool const cardWide = prop == cpTriggerMap;
+		uint16_t const addr =
+		    GEN_ADDR(cardWide ? Channel(0) : chan,
+			     IntLevel(start + table[ii].bias, prop));
+
+		uint16_t const owner =
+		    (uint16_t) (cardWide ? size_t(wholeCard) : size_t(chan));
+
+		if (queueWrite(lock, owner, addr, ptr, n))
+		    return true;
+		break;
+	    }
+    return (this->*func)(lock, chan, start, ptr, n);
+}
+
+bool Card::deferRamp(Card::LockType const& lock, Channel const& chan,
+		     uint16_t const ramp, uint16_t const offset,
+		     uint16_t const* const ptr, uint16_t const n,
+		     bool const urgent)
+{
+    if (ramp >= 16 || offset >= 64)
+	throw std::logic_error("bad ramp or segment offset");
+
+    uint16_t const addr =
+	GEN_ADDR(chan, IntLevel(2 * offset, ChannelProperty(ramp << 7)));
+
+    return (!urgent && queueWrite(lock, chan, addr, ptr, n)) ||
+	setRamp(lock, chan, ramp, offset, ptr, n);
+}
+
+size_t Card::flushWrites(Card::LockType const& lock, bool const force)
+{
+    unsigned long const now = tickGet();
+    unsigned long const maxAge =
+	(v473_write_max_defer_ms * sysClkRateGet()) / 1000;
+    bool ready[5] = { false, false, false, false, false };
+    bool idle[4] = { false, false, false, false };
+    bool checked[4] = { false, false, false, false };
+
+    // Decide which channels can be written. Each channel's activity
+    // is read once, and only if it has queued writes. Card-wide
+    // writes wait for every channel to be idle.
+
+    for (size_t ii = 0; ii < queuedWrites; ++ii) {
+	QueuedWrite const& w = writeQueue[ii];
+
+	if (force || now - w.queued >= maxAge) {
+	    ready[w.chan] = true;
+	    continue;
+	}
+
+	size_t const first = w.chan == wholeCard ? 0 : w.chan;
+	size_t const last = w.chan == wholeCard ? 4 : w.chan + 1;
+	bool all = true;
+
+	for (size_t chan = first; chan < last; ++chan) {
+	    if (!checked[chan]) {
+		ChannelActivity act;
+
+		checked[chan] = true;
+		idle[chan] = readActivity(lock, chan, act) && act.idle();
+	    }
+	    all = all && idle[chan];
+	}
+	if (all)
+	    ready[w.chan] = true;
+    }
+
+    // Make the writes of the ready channels back to back and keep
+    // the rest, in order. A write that fails, or is refused, is
+    // dropped. While the queue is being compacted, the writes made
+    // mustn't trim it.
+
+    size_t kept = 0;
+    size_t made = 0;
+
+    flushing = true;
+    for (size_t ii = 0; ii < queuedWrites; ++ii) {
+	QueuedWrite const& w = writeQueue[ii];
+
+	if (ready[w.chan]) {
+	    try {
+		if (issueWrite(lock, w))
+		    ++made;
+	    }
+	    catch (int16_t const& e) {
+		printf("V473 deferred write to 0x%04x: error %d\n", w.addr, e);
+	    }
+	    catch (std::exception const& e) {
+		printf("V473 deferred write to 0x%04x: %s\n", w.addr, e.what());
+	    }
+	} else if (kept++ != ii)
+	    writeQueue[kept - 1] = w;
+    }
+    queuedWrites = kept;
+    flushing = false;
+    return made;
+}
+
+void Card::serviceWrites()
+{
+    try {
+	LockType lock(this, v473_lock_tmo);
+
+	flushWrites(lock, false);
+    }
+    catch (int16_t const& e) {
+	printf("V473 write scheduler: error %d\n", e);
+    }
+    catch (std::exception const& e) {
+	printf("V473 write scheduler: %s\n", e.what());
+    }
+}
@@ -0,0 +1,252 @@
+#include "v473.h"
+#include <cstdio>
+
+extern "C" UINT16 sysIn16(UINT16*);
+
+using namespace V473;
+
+// The firmware's sweep isn't documented beyond its registers. The
+// planner assumes that in the sweep modes a level's frequency moves
+// from its frequency table entry to the following entry, so a sweep
+// takes two adjacent entries, and that in the fixed modes it stays
+// at its entry.
+
+static uint16_t findOrAdd(uint16_t* const table, uint16_t& n,
+			  uint16_t const v)
+{
+    for (uint16_t ii = 0; ii < n; ++ii)
+	if (table[ii] == v)
+	    return ii;
+    if (n >= 32)
+	throw std::runtime_error("V473 sine table is full");
+    table[n] = v;
+    return n++;
+}
+
+// Finds, or makes, two adjacent entries holding `v0` and `v1`. A new
+// pair can share its first entry with the end of the table, which
+// lets consecutive sweeps chain.
+
+static uint16_t findOrAddPair(uint16_t* const table, uint16_t& n,
+			      uint16_t const v0, uint16_t const v1)
+{
+    for (uint16_t ii = 0; ii + 1 < n; ++ii)
+	if (table[ii] == v0 && table[ii + 1] == v1)
+	    return ii;
+
+    uint16_t const first = n && table[n - 1] == v0 ? n - 1 : n;
+
+    if (first + 2 > 32)
+	throw std::runtime_error("V473 sine table is full");
+    table[first] = v0;
+    table[first + 1] = v1;
+    n = first + 2;
+    return first;
+}
+
+static bool sweeping(uint16_t const mode)
+{
+    return mode == 3 || mode == 7;
+}
+
+void Card::planSweeps(SineSweep const* const sweeps, size_t const n,
+		      bool const loop, Card::SweepTables& t)
+{
+    bool sweep = false;
+
+    for (size_t ii = 0; ii < n; ++ii)
+	sweep = sweep || sweeps[ii].startFreq != sweeps[ii].endFreq;
+
+    t.mode = sweep ? (loop ? smSweepLoop : smSweep) :
+	(loop ? smFixedLoop : smFixed);
+    t.freqs = t.phases = 0;
+    t.levels = 0;
+
+    uint16_t endPhase = 0;
+
+    for (size_t ii = 0; ii < n; ++ii) {
+	SineSweep const& s = sweeps[ii];
+
+	if (s.level >= 32)
+	    throw int16_t(ERR_BADSLOT);
+	if (t.levels & (1u << s.level))
+	    throw std::logic_error("interrupt level planned twice");
+
+	uint16_t const phase = s.continuous && ii ? endPhase : s.phase;
+
+	t.freqMap[s.level] = sweep ?
+	    findOrAddPair(t.freq, t.freqs, s.startFreq, s.endFreq) :
+	    findOrAdd(t.freq, t.freqs, s.startFreq);
+	t.phaseMap[s.level] = findOrAdd(t.phase, t.phases, phase);
+	t.levels |= 1u << s.level;
+
+	// A linear sweep advances the phase by the average frequency
+	// times the duration.
+
+	endPhase = (uint16_t) (phase + (((uint64_t) s.startFreq + s.endFreq) *
+					s.ticks >> 1));
+    }
+}
+
+// Finds where to put the planned entries `plan[0, n)` in a table
+// whose current contents are `table`. An entry another level still
+// refers to can't be changed, though it can be shared if it already
+// holds the planned value. Of the places that fit, the one needing
+// the fewest new words is used.
+
+static uint16_t placeEntries(uint16_t const* const table,
+			     bool const* const held,
+			     uint16_t const* const plan, uint16_t const n)
+{
+    size_t best = 32;
+    size_t bestSame = 0;
+
+    for (size_t base = 0; base + n <= 32; ++base) {
+	size_t same = 0;
+	bool fits = true;
+
+	for (size_t ii = 0; ii < n && fits; ++ii)
+	    if (table[base + ii] == plan[ii])
+		++same;
+	    else
+		fits = !held[base + ii];
+	if (fits && (best == 32 || same > bestSame)) {
+	    best = base;
+	    bestSame = same;
+	}
+    }
+    if (best == 32)
+	throw std::runtime_error("V473 sine table is full");
+    return (uint16_t) best;
+}
+
+bool Card::writeSweeps(Card::LockType const& lock, Channel const& chan,
+		       Card::SweepTables const& t)
+{
+    uint16_t trig[256];
+    bool used[32];
+    uint16_t freqMap[32], phaseMap[32], freq[32], phase[32];
+    bool const saved = cachedReads;
+    bool okay;
+
+    cachedReads = true;
+    okay = findUsedLevels(lock, trig, used) &&
+	getFrequencyMap(lock, chan, 0, freqMap, 32) &&
+	getPhaseMap(lock, chan, 0, phaseMap, 32) &&
+	getFrequencies(lock, chan, 0, freq, 32) &&
+	getPhases(lock, chan, 0, phase, 32);
+    cachedReads = saved;
+    if (!okay)
+	return false;
+
+    // The entries referred to by the levels outside the plan, and by
+    // planned levels that are triggered or playing until their map
+    // entries move, are held. In a sweep mode a level also uses the
+    // entry after its own.
+
+    bool heldFreq[32] = { false };
+    bool heldPhase[32] = { false };
+    size_t const step = sweeping(t.mode) ? 1 : 0;
+
+    for (size_t ii = 0; ii < 32; ++ii)
+	if (!(t.levels & (1u << ii)) || used[ii]) {
+	    for (size_t jj = freqMap[ii]; jj <= freqMap[ii] + step; ++jj)
+		if (jj < 32)
+		    heldFreq[jj] = true;
+	    if (phaseMap[ii] < 32)
+		heldPhase[phaseMap[ii]] = true;
+	}
+
+    uint16_t const freqBase = placeEntries(freq, heldFreq, t.freq, t.freqs);
+    uint16_t const phaseBase =
+	placeEntries(phase, heldPhase, t.phase, t.phases);
+
+    for (size_t ii = 0; ii < 32; ++ii)
+	if (t.levels & (1u << ii)) {
+	    freqMap[ii] = t.freqMap[ii] + freqBase;
+	    phaseMap[ii] = t.phaseMap[ii] + phaseBase;
+	}
+
+    // The tables go first, so no level is mapped to an entry before
+    // it holds its value. Each is one write, or none if the card
+    // already holds it.
+
+    return (!t.freqs ||
+	    !shadowDiffers(GEN_ADDR(chan, IntLevel(freqBase, cpFrequencies)),
+			   t.freq, t.freqs) ||
+	    setFrequencies(lock, chan, freqBase, t.freq, t.freqs)) &&
+	(!t.phases ||
+	 !shadowDiffers(GEN_ADDR(chan, IntLevel(phaseBase, cpPhases)),
+			t.phase, t.phases) ||
+	 setPhases(lock, chan, phaseBase, t.phase, t.phases)) &&
+	(!shadowDiffers(GEN_ADDR(chan, IntLevel(0, cpFrequencyMap)), freqMap,
+			32) ||
+	 setFrequencyMap(lock, chan, 0, freqMap, 32)) &&
+	(!shadowDiffers(GEN_ADDR(chan, IntLevel(0, cpPhaseMap)), phaseMap,
+			32) ||
+	 setPhaseMap(lock, chan, 0, phaseMap, 32)) &&
+	setSineWaveMode(lock, chan, t.mode);
+}
+
+// The active frequency of a planned level must lie within its sweep,
+// and the final (saved) frequency, once a level has finished, must be
+// where one of the planned levels ends.
+
+bool Card::verifySweep(Card::LockType const& lock, Channel const& chan,
+		       Card::SweepTables const& t, Card::SweepCheck& c)
+{
+    if (!getCurrentIntLvl(lock, &c.level) ||
+	!readProperty(lock, GEN_ADDR(chan, cpActiveSineWaveFreq), 4))
+	return false;
+
+    c.activeFreq = sysIn16(dataBuffer);
+    c.activePhase = sysIn16(dataBuffer + 1);
+    c.finalFreq = sysIn16(dataBuffer + 2);
+    c.finalPhase = sysIn16(dataBuffer + 3);
+    c.planned = c.level < 32 && (t.levels & (1u << c.level));
+    c.matches = false;
+
+    if (c.planned) {
+	size_t const step = sweeping(t.mode) ? 1 : 0;
+	uint16_t const f0 = t.freq[t.freqMap[c.level]];
+	uint16_t const f1 = t.freq[t.freqMap[c.level] + step];
+	bool ended = !c.finalFreq;
+
+	for (size_t ii = 0; ii < 32 && !ended; ++ii)
+	    if (t.levels & (1u << ii))
+		ended = t.freq[t.freqMap[ii] + step] == c.finalFreq;
+
+	c.matches = ended && c.activeFreq >= std::min(f0, f1) &&
+	    c.activeFreq <= std::max(f0, f1);
+    }
+    return true;
+}
+
+// Prints the channel's sine-wave registers.
+
+STATUS v473_sine_show(V473::HANDLE const hw, int const chan)
+{
+    try {
+	Card::SweepTables t;
+	Card::SweepCheck c;
+	Card::LockType lock(hw);
+
+	t.levels = 0;
+	t.mode = 0;
+	if (!hw->verifySweep(lock, chan, t, c)) {
+	    printf("couldn't read the card\n");
+	    return ERROR;
+	}
+	printf("level %u: active freq 0x%04x phase 0x%04x, "
+	       "final freq 0x%04x phase 0x%04x\n", c.level, c.activeFreq,
+	       c.activePhase, c.finalFreq, c.finalPhase);
+	return OK;
+    }
+    catch (int16_t const& e) {
+	printf("error %d\n", e);
+    }
+    catch (std::exception const& e) {
+	printf("caught: %s\n", e.what());
+    }
+    return ERROR;
+}
@@ -0,0 +1,145 @@
+#include "v473.h"
+
+using namespace V473;
+
+// Finds a slot for `v`. A slot that holds the value and is in use is
+// best, then one that holds it but is unused, and then any unused
+// slot, which is given the value.
+
+static uint16_t allocSlot(uint16_t* const table, uint8_t* const refs,
+			  size_t const first, uint16_t const v)
+{
+    size_t best = 32;
+
+    for (size_t ii = first; ii < 32; ++ii)
+	if (table[ii] == v && (best == 32 || refs[ii] > refs[best]))
+	    best = ii;
+    for (size_t ii = first; ii < 32 && best == 32; ++ii)
+	if (!refs[ii]) {
+	    table[ii] = v;
+	    best = ii;
+	}
+    if (best == 32)
+	throw std::runtime_error("no free V473 table slot");
+    ++refs[best];
+    return (uint16_t) best;
+}
+
+// Writes the words of `now` that differ from `was`, in [first, 32).
+// Runs separated by a couple of unchanged words are written as one,
+// since a command costs more than the words. `bias` is subtracted
+// from the index to get the writer's starting argument.
+
+static bool writeRuns(Card& card, Card::LockType const& lock,
+		      Card::Channel const& chan, Card::TableWriter const func,
+		      uint16_t const* const was, uint16_t const* const now,
+		      size_t const first, size_t const bias, uint16_t& writes)
+{
+    size_t ii = first;
+
+    while (ii < 32) {
+	if (was[ii] == now[ii]) {
+	    ++ii;
+	    continue;
+	}
+
+	size_t end = ii + 1;
+
+	for (size_t jj = end; jj < 32 && jj <= end + 2; ++jj)
+	    if (was[jj] != now[jj])
+		end = jj + 1;
+
+	if (!(card.*func)(lock, chan, (uint16_t) (ii - bias), now + ii,
+			   (uint16_t) (end - ii)))
+	    return false;
+	++writes;
+	ii = end;
+    }
+    return true;
+}
+
+bool Card::assignScaling(Card::LockType const& lock, Channel const& chan,
+			 Card::LevelScaling const* const req, size_t const n,
+			 Card::ScalingSlots& out)
+{
+    uint16_t trig[256];
+    bool used[32];
+    uint16_t scaleMap[32], offsetMap[32], scales[32], offsets[32];
+    bool const saved = cachedReads;
+    bool okay;
+
+    cachedReads = true;
+    okay = findUsedLevels(lock, trig, used) &&
+	getScaleFactorMap(lock, chan, 0, scaleMap, 32) &&
+	getOffsetMap(lock, chan, 0, offsetMap, 32) &&
+	getScaleFactors(lock, chan, 0, scales + 1, 31) &&
+	getOffsets(lock, chan, 0, offsets, 32);
+    cachedReads = saved;
+    if (!okay)
+	return false;
+    scales[0] = 0;
+
+    bool assigned[32] = { false };
+
+    for (size_t ii = 0; ii < n; ++ii) {
+	if (req[ii].level >= 32)
+	    throw int16_t(ERR_BADSLOT);
+	if (assigned[req[ii].level])
+	    throw std::logic_error("interrupt level assigned twice");
+	assigned[req[ii].level] = true;
+    }
+
+    // Count the references of every level that keeps its slots,
+    // whether it's in use or not. A level being reassigned that's
+    // triggered or playing also holds its old slots, so they aren't
+    // given new values before its map entries move it off them.
+
+    for (size_t ii = 0; ii < 32; ++ii)
+	out.scaleRefs[ii] = out.offsetRefs[ii] = 0;
+    for (size_t ii = 0; ii < 32; ++ii)
+	if (!assigned[ii] || used[ii]) {
+	    if (scaleMap[ii] >= 1 && scaleMap[ii] < 32)
+		++out.scaleRefs[scaleMap[ii]];
+	    if (offsetMap[ii] < 32)
+		++out.offsetRefs[offsetMap[ii]];
+	}
+
+    uint16_t newScaleMap[32], newOffsetMap[32], newScales[32], newOffsets[32];
+
+    for (size_t ii = 0; ii < 32; ++ii) {
+	newScaleMap[ii] = scaleMap[ii];
+	newOffsetMap[ii] = offsetMap[ii];
+	newScales[ii] = scales[ii];
+	newOffsets[ii] = offsets[ii];
+    }
+    for (size_t ii = 0; ii < n; ++ii) {
+	LevelScaling const& r = req[ii];
+
+	newScaleMap[r.level] = allocSlot(newScales, out.scaleRefs, 1, r.scale);
+	newOffsetMap[r.level] =
+	    allocSlot(newOffsets, out.offsetRefs, 0, r.offset);
+    }
+
+    // Once the maps are written, the old slots are no longer held.
+
+    for (size_t ii = 0; ii < 32; ++ii)
+	if (assigned[ii] && used[ii]) {
+	    if (scaleMap[ii] >= 1 && scaleMap[ii] < 32)
+		--out.scaleRefs[scaleMap[ii]];
+	    if (offsetMap[ii] < 32)
+		--out.offsetRefs[offsetMap[ii]];
+	}
+
+    // The tables go first, so no level is mapped to a slot before it
+    // holds the level's value.
+
+    out.writes = 0;
+    return writeRuns(*this, lock, chan, &Card::setScaleFactors, scales,
+		     newScales, 1, 1, out.writes) &&
+	writeRuns(*this, lock, chan, &Card::setOffsets, offsets, newOffsets,
+		  0, 0, out.writes) &&
+	writeRuns(*this, lock, chan, &Card::setScaleFactorMap, scaleMap,
+		  newScaleMap, 0, 0, out.writes) &&
+	writeRuns(*this, lock, chan, &Card::setOffsetMap, offsetMap,
+		  newOffsetMap, 0, 0, out.writes);
+}
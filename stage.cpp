@@ -0,0 +1,406 @@
+#include "v473.h"
+#include <cstdio>
+#include <tickLib.h>
+#include <taskLib.h>
+#include <sysLib.h>
+
+using namespace V473;
+
+// Returns the first value in [1, limit) that no interrupt level,
+// other than `except`, maps to. A level that isn't triggered now
+// may be later, so idle levels keep their slots too.
+
+static uint16_t freeSlot(uint16_t const map[32], uint16_t const except,
+			 uint16_t const limit)
+{
+    bool taken[32] = { false };
+
+    for (size_t ii = 0; ii < 32; ++ii)
+	if (ii != except && map[ii] < 32)
+	    taken[map[ii]] = true;
+    for (uint16_t ii = 1; ii < limit; ++ii)
+	if (!taken[ii])
+	    return ii;
+    throw std::runtime_error("no free V473 table slot");
+}
+
+// The configuration of one channel's interrupt levels, as held in the
+// card's maps.
+
+namespace {
+
+    struct LevelMaps {
+	uint16_t ramp[32];
+	uint16_t scale[32];
+	uint16_t offset[32];
+	uint16_t freq[32];
+	uint16_t phase[32];
+	uint16_t delay[32];
+    };
+
+    // Reads through the configuration copy while the object exists,
+    // so the maps and the trigger map are only read from the card
+    // the first time after a reset.
+
+    class ReadThrough {
+	Card& card;
+	Card::LockType const& lock;
+	bool const saved;
+
+	ReadThrough(ReadThrough const&);
+	ReadThrough& operator=(ReadThrough const&);
+
+     public:
+	ReadThrough(Card& c, Card::LockType const& l) :
+	    card(c), lock(l), saved(c.getCachedReads(l))
+	{
+	    card.setCachedReads(lock, true);
+	}
+
+	~ReadThrough() { card.setCachedReads(lock, saved); }
+    };
+
+};
+
+// Reads the trigger map into `trig` (256 words) and marks the
+// interrupt levels in use: those an event triggers and the one
+// that's playing.
+
+bool Card::findUsedLevels(Card::LockType const& lock, uint16_t* const trig,
+			  bool* const used)
+{
+    uint16_t active;
+
+    if (!getTriggerMap(lock, 0, 0, trig, 256) ||
+	!getCurrentIntLvl(lock, &active))
+	return false;
+
+    for (size_t ii = 0; ii < 32; ++ii) {
+	used[ii] = ii == active;
+	for (size_t jj = 0; jj < 8; ++jj)
+	    if (!unusedEvent(trig[ii * 8 + jj]))
+		used[ii] = true;
+    }
+    return true;
+}
+
+bool Card::commit(Card::LockType const& lock, Card::Stage const& stage,
+		  Card::CommitResult& res)
+{
+    ReadThrough const rt(*this, lock);
+
+    return commitStage(lock, stage, res);
+}
+
+bool Card::commitStage(Card::LockType const& lock, Card::Stage const& stage,
+		       Card::CommitResult& res)
+{
+    uint16_t trig[256];
+    bool used[32];
+
+    if (!findUsedLevels(lock, trig, used))
+	return false;
+
+    uint16_t const from = stage.intLvl;
+    uint16_t target = from;
+
+    // Prefer the other level of the even/odd pair, so repeated
+    // commits ping-pong between two levels, then the neighbours.
+
+    if (used[from]) {
+	uint16_t const near[3] = {
+	    uint16_t(from ^ 1), uint16_t(from + 1), uint16_t(from - 1)
+	};
+
+	target = 32;
+	for (size_t ii = 0; ii < 3 && target == 32; ++ii)
+	    if (near[ii] < 32 && !used[near[ii]])
+		target = near[ii];
+	for (uint16_t ii = 0; ii < 32 && target == 32; ++ii)
+	    if (!used[ii])
+		target = ii;
+	if (target == 32)
+	    throw std::runtime_error("no unused V473 interrupt level");
+    }
+
+    bool okay = true;
+
+    for (size_t chan = 0; okay && chan < 4; ++chan) {
+	Stage::Entry const& e = stage.entry[chan];
+	LevelMaps m;
+
+	okay = getRampMap(lock, chan, 0, m.ramp, 32) &&
+	    getScaleFactorMap(lock, chan, 0, m.scale, 32) &&
+	    getOffsetMap(lock, chan, 0, m.offset, 32) &&
+	    getFrequencyMap(lock, chan, 0, m.freq, 32) &&
+	    getPhaseMap(lock, chan, 0, m.phase, 32) &&
+	    getDelays(lock, chan, 0, m.delay, 32);
+
+	uint16_t ramp = m.ramp[from];
+	uint16_t scale = m.scale[from];
+	uint16_t offset = m.offset[from];
+	uint16_t freq = m.freq[from];
+	uint16_t phase = m.phase[from];
+	uint16_t delay = m.delay[from];
+
+	// Staged values go to slots that no level but the target
+	// refers to.
+
+	if (okay && (e.fields & Stage::sfRamp)) {
+	    ramp = freeSlot(m.ramp, target, 16);
+	    okay = setRamp(lock, chan, ramp, 0, e.ramp, e.rampLen);
+	}
+	if (okay && (e.fields & Stage::sfScale)) {
+	    scale = freeSlot(m.scale, target, 32);
+	    okay = setScaleFactors(lock, chan, scale - 1, &e.scale, 1);
+	}
+	if (okay && (e.fields & Stage::sfOffset)) {
+	    offset = freeSlot(m.offset, target, 32);
+	    okay = setOffsets(lock, chan, offset, &e.offset, 1);
+	}
+	if (okay && (e.fields & Stage::sfFreq)) {
+	    freq = freeSlot(m.freq, target, 32);
+	    okay = setFrequencies(lock, chan, freq, &e.freq, 1);
+	}
+	if (okay && (e.fields & Stage::sfPhase)) {
+	    phase = freeSlot(m.phase, target, 32);
+	    okay = setPhases(lock, chan, phase, &e.phase, 1);
+	}
+	if (e.fields & Stage::sfDelay)
+	    delay = e.delay;
+
+	// Point the target level at the configuration, skipping the
+	// entries that already hold the right value.
+
+	if (okay && m.ramp[target] != ramp)
+	    okay = setRampMap(lock, chan, target, &ramp, 1);
+	if (okay && m.scale[target] != scale)
+	    okay = setScaleFactorMap(lock, chan, target, &scale, 1);
+	if (okay && m.offset[target] != offset)
+	    okay = setOffsetMap(lock, chan, target, &offset, 1);
+	if (okay && m.freq[target] != freq)
+	    okay = setFrequencyMap(lock, chan, target, &freq, 1);
+	if (okay && m.phase[target] != phase)
+	    okay = setPhaseMap(lock, chan, target, &phase, 1);
+	if (okay && m.delay[target] != delay)
+	    okay = setDelays(lock, chan, target, &delay, 1);
+    }
+
+    res.level = target;
+    res.event = 0;
+    res.switched = false;
+    res.confirmed = false;
+    res.effectTime = 0;
+
+    // Move the events with one write that covers both levels, so the
+    // card never sees the events in both places, or in neither.
+
+    if (okay && target != from) {
+	size_t const lo = std::min(from, target);
+	size_t const hi = std::max(from, target);
+
+	for (size_t ii = 0; ii < 8; ++ii) {
+	    trig[target * 8 + ii] = trig[from * 8 + ii];
+	    trig[from * 8 + ii] = 0x00fe;
+	}
+	okay = writeBank(lock, 0, cpTriggerMap, lo * 8, trig + lo * 8,
+			 (hi - lo + 1) * 8);
+	res.switched = okay;
+    }
+    res.switchTime = timeStamp();
+    return okay;
+}
+
+bool Card::confirmCommit(Card::LockType const& lock, Card::CommitResult& res)
+{
+    uint16_t lvl;
+
+    if (res.confirmed)
+	return true;
+    if (!getCurrentIntLvl(lock, &lvl))
+	return false;
+    if (lvl == res.level) {
+	res.effectTime = timeStamp();
+	res.confirmed = true;
+	return getLastTclkEvent(lock, &res.event);
+    }
+    return true;
+}
+
+bool Card::waitCommit(Card::CommitResult& res, int const tmo)
+{
+    unsigned long const deadline =
+	tickGet() + (tmo * sysClkRateGet() + 999) / 1000;
+
+    while (true) {
+	{
+	    LockType lock(this, tmo);
+
+	    if (!confirmCommit(lock, res))
+		return false;
+	}
+	if (res.confirmed)
+	    return true;
+	if ((long) (deadline - tickGet()) <= 0)
+	    return false;
+	taskDelay(1);
+    }
+}
+
+void Card::initPingPong(Card::PingPong& pp, uint16_t const lvl,
+			uint16_t const mask)
+{
+    if (lvl >= 32)
+	throw int16_t(ERR_BADSLOT);
+
+    pp.level = lvl;
+    pp.chanMask = mask & 0xf;
+    pp.last.level = lvl;
+    pp.last.confirmed = true;
+    pp.prev = pp.last;
+    pp.writeTime = 0;
+    pp.frames = pp.confirmed = pp.replaced = pp.failed = 0;
+}
+
+bool Card::playFrame(Card::PingPong& pp, uint16_t const* const* const ramps,
+		     size_t const n, int const tmo)
+{
+    // Don't guess when the previous frame started: ask the card. If
+    // it still hasn't started, the new frame replaces it.
+
+    if (!pp.last.confirmed) {
+	if (waitCommit(pp.last, tmo))
+	    ++pp.confirmed;
+	else
+	    ++pp.replaced;
+    }
+    pp.prev = pp.last;
+
+    uint32_t const start = timeStamp();
+    Stage stage(pp.level);
+
+    for (size_t chan = 0; chan < 4; ++chan)
+	if (pp.chanMask & (1 << chan))
+	    stage.setRamp(chan, ramps[chan], n);
+
+    LockType lock(this, tmo);
+
+    bool const okay = commit(lock, stage, pp.last);
+
+    pp.writeTime = timeStamp() - start;
+    if (okay) {
+	pp.level = pp.last.level;
+	++pp.frames;
+	return true;
+    }
+    ++pp.failed;
+    pp.last.confirmed = true;
+    return false;
+}
+
+// FNV-1a hash of a ramp's words.
+
+static uint32_t rampHash(uint16_t const* const ptr, size_t const n)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t ii = 0; ii < n; ++ii) {
+	h = (h ^ (ptr[ii] & 0xff)) * 16777619u;
+	h = (h ^ (ptr[ii] >> 8)) * 16777619u;
+    }
+    return h;
+}
+
+bool Card::playRamp(Card::LockType const& lock, Channel const& chan,
+		    uint16_t const intLvl, uint16_t const* const ptr,
+		    size_t const n)
+{
+    if (intLvl >= 32)
+	throw int16_t(ERR_BADSLOT);
+    if (n > 128)
+	throw std::logic_error("ramp longer than 64 segments");
+
+    ReadThrough const rt(*this, lock);
+    RampSlot* const slot = rampSlot[chan];
+    uint32_t const hash = rampHash(ptr, n);
+    uint16_t map[32];
+
+    if (!getRampMap(lock, chan, 0, map, 32))
+	return false;
+
+    // Look for the ramp. The tag may be stale, or collide, so the
+    // slot's contents are compared with the ramp.
+
+    uint16_t found = 0;
+
+    for (uint16_t ii = 1; ii < 16 && !found; ++ii)
+	if (slot[ii].hash == hash &&
+	    !shadowDiffers(GEN_ADDR(chan, ChannelProperty(ii << 7)), ptr, n))
+	    found = ii;
+
+    if (found)
+	++rampStats[chan].hits;
+    else {
+	uint16_t trig[256];
+	bool used[32];
+	bool taken[16] = { true };	// slot 0 isn't a ramp slot
+
+	if (!findUsedLevels(lock, trig, used))
+	    return false;
+
+	// A slot that any other level refers to isn't touched, even
+	// if the level isn't triggered now. The level's own slot is
+	// only reused if the level can't play.
+
+	for (size_t ii = 0; ii < 32; ++ii)
+	    if ((ii != intLvl || used[ii]) && map[ii] < 16)
+		taken[map[ii]] = true;
+
+	for (uint16_t ii = 1; ii < 16; ++ii)
+	    if (!taken[ii] && (!found || slot[ii].lastUse < slot[found].lastUse))
+		found = ii;
+	if (!found)
+	    throw std::runtime_error("no free V473 ramp slot");
+
+	++rampStats[chan].misses;
+	if (slot[found].lastUse)
+	    ++rampStats[chan].evictions;
+
+	slot[found].hash = 0;
+	if (!setRamp(lock, chan, found, 0, ptr, n))
+	    return false;
+	slot[found].hash = hash;
+    }
+    slot[found].lastUse = ++rampClock[chan];
+
+    return map[intLvl] == found || setRampMap(lock, chan, intLvl, &found, 1);
+}
+
+void Card::clearRampCacheStats(Card::LockType const&)
+{
+    for (size_t ii = 0; ii < 4; ++ii)
+	rampStats[ii].hits = rampStats[ii].misses = rampStats[ii].evictions = 0;
+}
+
+// Displays the ramp slot cache counters of each channel of a card.
+
+STATUS v473_ramp_cache_show(V473::HANDLE const hw)
+{
+    try {
+	V473::Card::LockType lock(hw);
+
+	printf("CHAN  HITS        MISSES      EVICTIONS\n");
+	for (size_t chan = 0; chan < 4; ++chan) {
+	    V473::Card::RampCacheStats const& st =
+		hw->getRampCacheStats(lock, chan);
+
+	    printf("%-4u  %-10u  %-10u  %u\n", chan, st.hits, st.misses,
+		   st.evictions);
+	}
+	return OK;
+    }
+    catch (std::exception const& e) {
+	printf("caught: %s\n", e.what());
+	return ERROR;
+    }
+}
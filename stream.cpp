@@ -0,0 +1,197 @@
+#include "v473.h"
+#include <taskLib.h>
+#include <tickLib.h>
+#include <sysLib.h>
+#include <cstdio>
+
+using namespace V473;
+
+Feeder::Feeder(Card* const c, uint16_t const lvl, uint16_t const mask,
+	       int const dl) :
+    card(c), deadline(dl), frame(new Frame[maxFrames]), head(0), tail(0),
+    lastQueued(0), ready(semBCreate(SEM_Q_FIFO, SEM_EMPTY)),
+    done(semBCreate(SEM_Q_FIFO, SEM_EMPTY)), running(true)
+{
+    clearStats();
+    try {
+	if (dl <= 0)
+	    throw std::logic_error("feeder deadline must be positive");
+	Card::initPingPong(pp, lvl, mask);
+	if (!ready || !done ||
+	    ERROR == taskSpawn((char*) "tV473Feed", 60, VX_FP_TASK, 8192,
+			       (FUNCPTR) Feeder::task, (int) this, 0, 0, 0, 0,
+			       0, 0, 0, 0, 0))
+	    throw std::runtime_error("couldn't start the V473 feeder task");
+    }
+    catch (...) {
+	if (ready)
+	    semDelete(ready);
+	if (done)
+	    semDelete(done);
+	delete [] frame;
+	throw;
+    }
+}
+
+// Stops the feeder task, after it finishes the frame it's playing,
+// and throws away any queued frames.
+
+Feeder::~Feeder()
+{
+    running = false;
+    semGive(ready);
+    semTake(done, WAIT_FOREVER);
+    semDelete(ready);
+    semDelete(done);
+    delete [] frame;
+}
+
+bool Feeder::push(uint16_t const* const* const ramps, size_t const n)
+{
+    if (n > 128)
+	throw std::logic_error("ramp longer than 64 segments");
+
+    // The feeder only reads `tail`, and only this function writes
+    // it, so the frame can be filled in without a lock. It's
+    // published by advancing `tail` once it's complete; doing that
+    // with interrupts locked out keeps the frame's stores from being
+    // moved past it.
+
+    if (tail - head >= maxFrames) {
+	++stats.overflowed;
+	return false;
+    }
+
+    Frame& f = frame[tail % maxFrames];
+
+    for (size_t chan = 0; chan < 4; ++chan)
+	if (pp.chanMask & (1 << chan))
+	    for (size_t ii = 0; ii < n; ++ii)
+		f.ramp[chan][ii] = ramps[chan][ii];
+    f.n = (uint16_t) n;
+    f.queued = timeStamp();
+    f.deadline = tickGet() + (deadline * sysClkRateGet() + 999) / 1000;
+
+    {
+	vwpp::v3_0::IntLock const lock;
+
+	tail = tail + 1;
+    }
+    ++stats.pushed;
+    semGive(ready);
+    return true;
+}
+
+void Feeder::play(Feeder::Frame const& f)
+{
+    uint16_t const* ramps[4];
+    uint32_t const confirmed = pp.confirmed;
+    bool okay = false;
+
+    for (size_t chan = 0; chan < 4; ++chan)
+	ramps[chan] = f.ramp[chan];
+
+    try {
+	okay = card->playFrame(pp, ramps, f.n, deadline);
+    }
+    catch (int16_t const& e) {
+	printf("V473 feeder: error %d\n", e);
+    }
+    catch (std::exception const& e) {
+	printf("V473 feeder: %s\n", e.what());
+    }
+
+    if (pp.confirmed != confirmed)
+	stats.playLatency.record(tbToUsec(pp.prev.effectTime - lastQueued));
+
+    if (okay) {
+	stats.writeLatency.record(tbToUsec(timeStamp() - f.queued));
+	if ((long) (tickGet() - f.deadline) > 0)
+	    ++stats.late;
+	else
+	    ++stats.onTime;
+	lastQueued = f.queued;
+    } else
+	++stats.failed;
+}
+
+int Feeder::task(Feeder* const self)
+{
+    while (self->running) {
+	semTake(self->ready, WAIT_FOREVER);
+
+	while (self->running && self->head != self->tail) {
+	    uint32_t const h = self->head;
+	    Frame const& f = self->frame[h % maxFrames];
+
+	    // A late frame is skipped if there's a newer one to play.
+
+	    if (self->tail - h > 1 && (long) (tickGet() - f.deadline) > 0)
+		++self->stats.dropped;
+	    else
+		self->play(f);
+
+	    // The slot is handed back only after it's been read.
+
+	    vwpp::v3_0::IntLock const lock;
+
+	    self->head = h + 1;
+	}
+    }
+    semGive(self->done);
+    return 0;
+}
+
+// The counters are updated without locks, each by one task, so a
+// copy is taken with interrupts (and task switches) locked out.
+
+Feeder::Stats Feeder::getStats() const
+{
+    vwpp::v3_0::IntLock const lock;
+
+    return stats;
+}
+
+void Feeder::clearStats()
+{
+    vwpp::v3_0::IntLock const lock;
+
+    stats.pushed = stats.overflowed = stats.onTime = stats.late =
+	stats.dropped = stats.failed = 0;
+    stats.writeLatency.clear();
+    stats.playLatency.clear();
+}
+
+V473::Feeder* v473_feeder_create(V473::HANDLE const hw, int const lvl,
+				 int const mask, int const deadline)
+{
+    try {
+	return new Feeder(hw, (uint16_t) lvl, (uint16_t) mask, deadline);
+    }
+    catch (int16_t const& e) {
+	printf("error %d\n", e);
+    }
+    catch (std::exception const& e) {
+	printf("caught: %s\n", e.what());
+    }
+    return 0;
+}
+
+STATUS v473_feeder_show(V473::Feeder* const feeder)
+{
+    if (!feeder) {
+	printf("usage: v473_feeder_show feeder\n");
+	return ERROR;
+    }
+
+    Feeder::Stats const st = feeder->getStats();
+
+    printf("pushed %u, overflowed %u, on time %u, late %u, dropped %u, "
+	   "failed %u\n", st.pushed, st.overflowed, st.onTime, st.late,
+	   st.dropped, st.failed);
+    printf("LATENCY (us)  WRITTEN     PLAYING\n");
+    for (size_t ii = 0; ii < Histogram::buckets; ++ii)
+	printf("< %-10u  %-10u  %u\n", 2u << ii, st.writeLatency[ii],
+	       st.playLatency[ii]);
+    return OK;
+}
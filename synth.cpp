@@ -0,0 +1,231 @@
+#include "v473.h"
+#include <cmath>
+#include <cstdio>
+
+using namespace V473;
+
+static int16_t sine[sineSize + 1];
+
+// The table is filled when the module is loaded, before any task can
+// use it, so readers don't need a lock.
+
+static void fillSine() __attribute__((constructor));
+
+static void fillSine()
+{
+    for (size_t ii = 0; ii <= sineSize; ++ii)
+	sine[ii] = (int16_t)
+	    lround(32767. * std::sin(ii * 6.283185307179586 / sineSize));
+}
+
+int16_t const* V473::sineTable()
+{
+    return sine;
+}
+
+static int16_t clamp(int32_t const v)
+{
+    return (int16_t) std::min(std::max(v, -32768), 32767);
+}
+
+namespace {
+
+    // Appends segments to a ramp, splitting spans that a delta can't
+    // hold, and keeps track of whether the ramp still fits.
+
+    class Emitter {
+	uint16_t* const ramp;
+	size_t segs;
+	int32_t last;
+	bool full;
+
+     public:
+	Emitter(uint16_t* const r, int32_t const start) :
+	    ramp(r), segs(0), last(start), full(false)
+	{}
+
+	// Moves linearly from the last value to `v` over `ticks`. A
+	// jump still takes a tick.
+
+	void line(int32_t const v, uint32_t const ticks)
+	{
+	    uint32_t const total = std::max(ticks, 1u);
+	    uint32_t const pieces = (total + 0xfffe) / 0xffff;
+	    uint32_t prev = 0;
+
+	    for (uint32_t ii = 1; ii <= pieces; ++ii) {
+		uint32_t const t =
+		    (uint32_t) (((uint64_t) total * ii) / pieces);
+
+		add(last + (int32_t) (((int64_t) (v - last) * t) / total),
+		    t - prev);
+		prev = t;
+	    }
+	    last = v;
+	}
+
+	void add(int32_t const v, uint32_t const delta)
+	{
+	    if (segs < maxSegments) {
+		ramp[segs * 2] = (uint16_t) clamp(v);
+		ramp[segs * 2 + 1] = (uint16_t) delta;
+		++segs;
+	    } else
+		full = true;
+	}
+
+	// Terminates the ramp by holding the last value.
+
+	size_t finish()
+	{
+	    if (full || !segs)
+		return 0;
+	    ramp[segs * 2] = ramp[segs * 2 - 2];
+	    ramp[segs * 2 + 1] = 0;
+	    return (segs + 1) * 2;
+	}
+    };
+}
+
+// The values are looked up in the sine table and interpolated
+// between neighbours, so the loop has no calls and no loop-carried
+// dependencies. Segment boundaries are rounded from the absolute
+// time so the period comes out exact.
+
+size_t V473::synthSine(uint16_t* const ramp, size_t const segments,
+		       uint32_t const period, int16_t const amplitude,
+		       int16_t const offset, uint16_t const phase)
+{
+    if (!segments || segments > maxSegments)
+	throw std::logic_error("bad number of sine segments");
+    if (period < segments || (period + segments - 1) / segments > 0xffff)
+	return 0;
+
+    int16_t const* const tbl = sineTable();
+    uint32_t const step = (uint32_t) (0x100000000ull / segments);
+    uint32_t const start = (uint32_t) phase << 16;
+
+    for (size_t ii = 0; ii < segments; ++ii) {
+	uint32_t const p = start + step * (uint32_t) (ii + 1);
+	uint32_t const idx = p >> (32 - sineBits);
+	int32_t const frac = (p >> (16 - sineBits)) & 0xffff;
+	int32_t const s =
+	    tbl[idx] + (((tbl[idx + 1] - tbl[idx]) * frac) >> 16);
+	int32_t const v = ((amplitude * s + 0x4000) >> 15) + offset;
+
+	ramp[ii * 2] = (uint16_t) clamp(v);
+	ramp[ii * 2 + 1] =
+	    (uint16_t) (((uint64_t) period * (ii + 1)) / segments -
+			((uint64_t) period * ii) / segments);
+    }
+    ramp[segments * 2] = ramp[segments * 2 - 2];
+    ramp[segments * 2 + 1] = 0;
+    return (segments + 1) * 2;
+}
+
+size_t V473::synthTrapezoid(uint16_t* const ramp, int16_t const base,
+			    int16_t const top, uint32_t const rise,
+			    uint32_t const flat, uint32_t const fall)
+{
+    Emitter e(ramp, base);
+
+    e.line(top, rise);
+    if (flat)
+	e.line(top, flat);
+    e.line(base, fall);
+    return e.finish();
+}
+
+// The parabolas are drawn with chords between points at equal
+// times. Their slope at the joins matches the linear part's, so the
+// total change is the slope times `ticks - curve`.
+
+size_t V473::synthPlp(uint16_t* const ramp, int16_t const from,
+		      int16_t const to, uint32_t const ticks,
+		      uint32_t const curve, size_t const segments)
+{
+    if (!segments || 2 * (uint64_t) curve > ticks)
+	throw std::logic_error("bad parabolic-linear-parabolic arguments");
+
+    Emitter e(ramp, from);
+    float const slope = (float) (to - from) / (float) (ticks - curve);
+    float const accel = curve ? slope / curve : 0.f;
+    uint32_t prev = 0;
+
+    for (size_t ii = 1; curve && ii <= segments; ++ii) {
+	uint32_t const t = (uint32_t) (((uint64_t) curve * ii) / segments);
+
+	e.line(lroundf(from + 0.5f * accel * t * t), t - prev);
+	prev = t;
+    }
+    if (ticks - 2 * curve)
+	e.line(lroundf(to - 0.5f * slope * curve), ticks - curve - prev);
+    prev = ticks - curve;
+    for (size_t ii = 1; curve && ii <= segments; ++ii) {
+	uint32_t const u = curve - (uint32_t) (((uint64_t) curve * ii) /
+					       segments);
+
+	e.line(lroundf(to - 0.5f * accel * u * u), ticks - u - prev);
+	prev = ticks - u;
+    }
+    return e.finish();
+}
+
+size_t V473::synthBreakpoints(uint16_t* const ramp, Breakpoint const* const bp,
+			      size_t const n)
+{
+    if (!n)
+	throw std::logic_error("no breakpoints");
+
+    Emitter e(ramp, bp[0].value);
+    uint32_t prev = 0;
+
+    for (size_t ii = 0; ii < n; ++ii) {
+	if (ii && bp[ii].time <= prev)
+	    throw std::logic_error("breakpoint times must increase");
+	e.line(bp[ii].value, bp[ii].time - prev);
+	prev = bp[ii].time;
+    }
+    return e.finish();
+}
+
+// Times the sine loop from v473_test against synthSine() for the
+// same 62 segment sine wave, and reports the largest difference
+// from an exact sine of the synthesized values.
+
+STATUS v473_synth_bench(int const n)
+{
+    if (n <= 0 || n > 1000000) {
+	printf("usage: v473_synth_bench iterations\n");
+	return ERROR;
+    }
+
+    uint16_t data[128];
+    uint32_t const t0 = timeStamp();
+
+    for (int jj = 0; jj < n; ++jj)
+	for (unsigned ii = 0; ii < 62; ++ii) {
+	    data[ii * 2] = (int16_t) (0x4000 * sin(ii * 6.2830 / 62));
+	    data[ii * 2 + 1] = (uint16_t) 105;
+	}
+
+    uint32_t const t1 = timeStamp();
+
+    for (int jj = 0; jj < n; ++jj)
+	synthSine(data, 62, 62 * 105, 0x4000, 0, 0);
+
+    uint32_t const t2 = timeStamp();
+    double maxErr = 0.;
+
+    for (unsigned ii = 0; ii < 62; ++ii)
+	maxErr = std::max(maxErr,
+			  std::fabs((int16_t) data[ii * 2] -
+				    0x4000 * sin((ii + 1) * 6.283185307179586 /
+						 62)));
+
+    printf("sin() loop: %u ns/ramp, synthSine: %u ns/ramp, "
+	   "max error %.2f counts\n",
+	   (unsigned) ((uint64_t) tbToUsec(t1 - t0) * 1000 / n),
+	   (unsigned) ((uint64_t) tbToUsec(t2 - t1) * 1000 / n), maxErr);
+    return OK;
+}
@@ -0,0 +1,291 @@
+#include "v473.h"
+#include <semLib.h>
+#include <taskLib.h>
+#include <tickLib.h>
+#include <sysLib.h>
+#include <cstdio>
+
+extern "C" UINT16 sysIn16(UINT16*);
+
+extern int v473_lock_tmo;
+
+using namespace V473;
+
+// The bit of the card's interrupt source register that the firmware
+// sets when an interrupt level starts. Firmware that doesn't raise
+// one leaves this 0, and the watcher task relies on polling. The bit
+// must not be one the driver already uses (0xd21f).
+
+int v473_tclk_irq = 0;
+
+// How often, in milliseconds, the watcher task polls cards while a
+// task waits for TCLK activity or writes are queued, and otherwise
+// (when only watchers are registered.) Each poll reads a card
+// through its mailbox, so the idle period is the longer one.
+
+int v473_tclk_poll_ms = 10;
+int v473_tclk_watch_ms = 100;
+
+static uint32_t volatile tclkWaiters = 0;
+static SEM_ID tclkSem = 0;
+static SEM_ID tclkPass = 0;
+static SEM_ID tclkCalls = 0;
+
+Card::TclkFired* Card::tclkFired = 0;
+size_t Card::tclkFiredCount = 0;
+static bool volatile tclkStarted = false;
+
+void V473::tclkNotify()
+{
+    if (tclkSem)
+	semGive(tclkSem);
+}
+
+// Starts the watcher task the first time anyone is interested in
+// TCLK activity.
+
+void Card::startTclkWatcher()
+{
+    {
+	vwpp::v3_0::IntLock lock;
+
+	if (tclkStarted)
+	    return;
+	tclkStarted = true;
+    }
+
+    tclkFired = new TclkFired[maxCards * maxTclkWatches];
+    tclkSem = semBCreate(SEM_Q_FIFO, SEM_EMPTY);
+    tclkCalls = semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE);
+    tclkPass = tclkCalls ?
+	semMCreate(SEM_Q_PRIORITY | SEM_INVERSION_SAFE) : 0;
+
+    if (!tclkSem || !tclkPass ||
+	ERROR == taskSpawn((char*) "tV473Tclk", 60, VX_FP_TASK, 8192,
+			   (FUNCPTR) Card::tclkTask, 0, 0, 0, 0, 0, 0, 0, 0,
+			   0, 0))
+	printf("ERROR: couldn't start the V473 TCLK watcher.\n");
+}
+
+// Waits for the watcher task to finish the pass over the cards it's
+// making, if any, and drops the card's callbacks that haven't been
+// made yet. A card that has left the registry isn't in the next
+// pass, so once this returns the task no longer refers to it. A
+// callback may destroy a card: the call locks are mutexes, which
+// the watcher task can take again.
+
+void Card::waitTclkPass()
+{
+    if (tclkPass) {
+	semTake(tclkPass, WAIT_FOREVER);
+	semGive(tclkPass);
+	semTake(tclkCalls, WAIT_FOREVER);
+	for (size_t ii = 0; ii < tclkFiredCount; ++ii)
+	    if (tclkFired[ii].card == this)
+		tclkFired[ii].card = 0;
+	semGive(tclkCalls);
+    }
+}
+
+// The watcher task. It sleeps until a card interrupts, or the poll
+// period runs out, then polls every card that someone is watching
+// and makes the deferred writes of channels that have gone idle.
+// Each pass holds `tclkPass`, so a card can't be destroyed under it.
+// The watchers whose conditions happened are called after the pass,
+// holding only `tclkCalls`, so a callback that destroys a card
+// doesn't wait on the pass it's part of.
+
+int Card::tclkTask()
+{
+    bool writing = false;
+
+    while (true) {
+	int const ms = tclkWaiters || writing ? v473_tclk_poll_ms :
+	    v473_tclk_watch_ms;
+
+	semTake(tclkSem, std::max(1, (ms * sysClkRateGet()) / 1000));
+	semTake(tclkCalls, WAIT_FOREVER);
+	semTake(tclkPass, WAIT_FOREVER);
+
+	CardInfo info[maxCards];
+	size_t const total = getCards(info, maxCards);
+
+	writing = false;
+	tclkFiredCount = 0;
+	for (size_t ii = 0; ii < total; ++ii) {
+	    if (info[ii].card->tclkInterest)
+		info[ii].card->pollTclk();
+	    if (info[ii].card->queuedWrites)
+		info[ii].card->serviceWrites();
+	    writing = writing || info[ii].card->queuedWrites;
+	}
+	semGive(tclkPass);
+
+	// Callbacks are made without the card locked, so they can use
+	// the card.
+
+	for (size_t ii = 0; ii < tclkFiredCount; ++ii) {
+	    TclkFired const f = tclkFired[ii];
+
+	    if (f.card)
+		f.watch.func(f.card, f.watch.arg, f.watch.cond, f.watch.which);
+	}
+	tclkFiredCount = 0;
+	semGive(tclkCalls);
+    }
+    return 0;
+}
+
+// Reads the card's interrupt counters, active level and last TCLK
+// event, updates the counts of level starts and events, wakes waiters
+// and queues the calls of the watchers whose condition happened.
+
+void Card::pollTclk()
+{
+    try {
+	LockType lock(this, v473_lock_tmo);
+	uint16_t counters[32];
+	uint16_t trig[256];
+	bool const saved = cachedReads;
+
+	// The trigger map comes from the configuration copy; the
+	// counters and registers always come from the card.
+
+	cachedReads = true;
+	bool const okay = getTriggerMap(lock, 0, 0, trig, 256);
+
+	cachedReads = false;
+	if (!okay || !getIntCounters(lock, 0, counters, 32) ||
+	    !readProperty(lock, GEN_ADDR(0, cpActiveInterruptLevel), 2)) {
+	    cachedReads = saved;
+	    return;
+	}
+	cachedReads = saved;
+
+	uint16_t const event = sysIn16(dataBuffer + 1) & 0xff;
+
+	if (!tclkPrimed) {
+	    for (size_t ii = 0; ii < 32; ++ii)
+		lastCounters[ii] = counters[ii];
+	    lastEvent = event;
+	    tclkPrimed = true;
+	    return;
+	}
+
+	// An event counts as seen if it's the latest event, or if it
+	// triggers a level that started since the last poll.
+
+	uint16_t started[32];
+	bool seen[256] = { false };
+
+	for (size_t ii = 0; ii < 32; ++ii) {
+	    started[ii] = (uint16_t) (counters[ii] - lastCounters[ii]);
+	    lastCounters[ii] = counters[ii];
+	    if (started[ii])
+		for (size_t jj = 0; jj < 8; ++jj)
+		    if (!unusedEvent(trig[ii * 8 + jj]))
+			seen[trig[ii * 8 + jj] & 0xff] = true;
+	}
+	if (event != lastEvent)
+	    seen[event] = true;
+	lastEvent = event;
+
+	{
+	    vwpp::v3_0::IntLock iLock;
+
+	    for (size_t ii = 0; ii < 32; ++ii)
+		levelStarts[ii] += started[ii];
+	    for (size_t ii = 0; ii < 256; ++ii)
+		if (seen[ii])
+		    ++eventsSeen[ii];
+	    for (size_t ii = 0; ii < maxTclkWatches; ++ii) {
+		TclkWatch const& w = tclkWatch[ii];
+
+		if (w.func &&
+		    (w.cond == tcLevelStarted ? started[w.which] != 0 :
+		     seen[w.which])) {
+		    tclkFired[tclkFiredCount].card = this;
+		    tclkFired[tclkFiredCount++].watch = w;
+		}
+	    }
+	}
+	tclkSeen.wakeAll();
+    }
+    catch (int16_t const& e) {
+	printf("V473 TCLK watcher: error %d\n", e);
+    }
+    catch (std::exception const& e) {
+	printf("V473 TCLK watcher: %s\n", e.what());
+    }
+}
+
+static void checkCondition(Card::TclkCondition const cond,
+			   uint16_t const which)
+{
+    if (which >= (cond == Card::tcLevelStarted ? 32 : 256))
+	throw std::logic_error("bad interrupt level or TCLK event");
+}
+
+bool Card::waitTclk(TclkCondition const cond, uint16_t const which,
+		    int const tmo)
+{
+    checkCondition(cond, which);
+    startTclkWatcher();
+
+    unsigned long const deadline =
+	tickGet() + (tmo * sysClkRateGet() + 999) / 1000;
+    uint32_t volatile const* const counter =
+	cond == tcLevelStarted ? levelStarts + which : eventsSeen + which;
+    vwpp::v3_0::IntLock iLock;
+    uint32_t const start = *counter;
+    bool result = true;
+
+    // The watcher polls faster while anyone waits; wake it so it
+    // switches now.
+
+    ++tclkInterest;
+    ++tclkWaiters;
+    tclkNotify();
+    while (*counter == start) {
+	long const left = (long) (deadline - tickGet());
+
+	if (left <= 0 ||
+	    !tclkSeen.wait(iLock, (left * 1000) / sysClkRateGet() + 1)) {
+	    result = *counter != start;
+	    break;
+	}
+    }
+    --tclkWaiters;
+    --tclkInterest;
+    return result;
+}
+
+int Card::addTclkWatch(TclkCondition const cond, uint16_t const which,
+		       TclkCallback const func, void* const arg)
+{
+    checkCondition(cond, which);
+    startTclkWatcher();
+
+    vwpp::v3_0::IntLock iLock;
+
+    for (size_t ii = 0; ii < maxTclkWatches; ++ii)
+	if (!tclkWatch[ii].func) {
+	    tclkWatch[ii].arg = arg;
+	    tclkWatch[ii].cond = cond;
+	    tclkWatch[ii].which = which;
+	    tclkWatch[ii].func = func;
+	    ++tclkInterest;
+	    return (int) ii;
+	}
+    throw std::runtime_error("too many TCLK watchers");
+}
+
+void Card::removeTclkWatch(int const handle)
+{
+    vwpp::v3_0::IntLock iLock;
+
+    if (handle >= 0 && handle < maxTclkWatches && tclkWatch[handle].func) {
+	tclkWatch[handle].func = 0;
+	--tclkInterest;
+    }
+}
@@ -0,0 +1,348 @@
+#include "v473.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using namespace V473;
+
+// The DABBEL template's primary transform turns a word into +/-10 V
+// (X / 3276.8) and its common transform multiplies by C1 / C2, so
+// the default coefficients of the ramp values, offsets, frequencies
+// and phases are C1 / (C2 * 3276.8), worked out when the table is
+// initialized. Scale factors are multiples of unity (256), and
+// delays and ramp segment times are 10 us ticks.
+
+static float const primary = 3276.8f;
+
+static UnitConv conv[ukKinds] = {
+    { 4.f / primary, 0.f, true },	// ramp values, amps
+    { 3.f / primary, 0.f, true },	// offsets, amps
+    { 1.f / 256.f, 0.f, true },		// scale factors
+    { 10.f, 0.f, false },		// delays, microseconds
+    { 5.f / primary, 0.f, false },	// frequencies, kHz
+    { 18.f / primary, 0.f, true },	// phases, degrees
+    { 10.f, 0.f, false }		// ramp segment times, microseconds
+};
+
+static char const* const kindName[ukKinds] = {
+    "ramp", "offsets", "scales", "delays", "frequencies", "phases", "time"
+};
+
+static UnitKind checkKind(UnitKind const kind)
+{
+    if (kind < 0 || kind >= ukKinds)
+	throw std::logic_error("bad unit kind");
+    return kind;
+}
+
+UnitConv V473::getUnitConv(UnitKind const kind)
+{
+    return conv[checkKind(kind)];
+}
+
+void V473::setUnitConv(UnitKind const kind, float const scale,
+		       float const offset)
+{
+    if (scale == 0.f)
+	throw std::logic_error("unit scale can't be zero");
+
+    UnitConv& c = conv[checkKind(kind)];
+
+    c.scale = scale;
+    c.offset = offset;
+}
+
+// The kernels work on every `stride`th value. The signedness test is
+// hoisted out of the loops and the clipping is done with min/max, so
+// the loop bodies have no branches and can be vectorized.
+
+static void euKernel(UnitConv const& c, uint16_t const* const raw,
+		     float* const eu, size_t const n, size_t const stride)
+{
+    if (c.isSigned)
+	for (size_t ii = 0; ii < n; ii += stride)
+	    eu[ii] = (float) (int16_t) raw[ii] * c.scale + c.offset;
+    else
+	for (size_t ii = 0; ii < n; ii += stride)
+	    eu[ii] = (float) raw[ii] * c.scale + c.offset;
+}
+
+static size_t rawKernel(UnitConv const& c, float const* const eu,
+			uint16_t* const raw, size_t const n,
+			size_t const stride)
+{
+    float const inv = 1.f / c.scale;
+    float const lo = c.isSigned ? -32768.f : 0.f;
+    float const hi = c.isSigned ? 32767.f : 65535.f;
+    size_t clipped = 0;
+
+    for (size_t ii = 0; ii < n; ii += stride) {
+	float const x = (eu[ii] - c.offset) * inv;
+	float const y = std::min(std::max(x, lo), hi);
+
+	clipped += y != x;
+	raw[ii] = (uint16_t) (int32_t) (y + (y < 0.f ? -0.5f : 0.5f));
+    }
+    return clipped;
+}
+
+void V473::toEngineering(UnitKind const kind, uint16_t const* const raw,
+			 float* const eu, size_t const n)
+{
+    euKernel(conv[checkKind(kind)], raw, eu, n, 1);
+}
+
+size_t V473::toRaw(UnitKind const kind, float const* const eu,
+		   uint16_t* const raw, size_t const n)
+{
+    return rawKernel(conv[checkKind(kind)], eu, raw, n, 1);
+}
+
+void V473::rampToEngineering(uint16_t const* const raw, float* const eu,
+			     size_t const n)
+{
+    euKernel(conv[ukRamp], raw, eu, n, 2);
+    euKernel(conv[ukTime], raw + 1, eu + 1, n ? n - 1 : 0, 2);
+}
+
+size_t V473::rampToRaw(float const* const eu, uint16_t* const raw,
+		       size_t const n)
+{
+    return rawKernel(conv[ukRamp], eu, raw, n, 2) +
+	rawKernel(conv[ukTime], eu + 1, raw + 1, n ? n - 1 : 0, 2);
+}
+
+static int findKind(char const* const name)
+{
+    for (int ii = 0; ii < ukKinds; ++ii)
+	if (!strcmp(name, kindName[ii]))
+	    return ii;
+    return -1;
+}
+
+// Writes one line of an engineering-unit file to the card.
+
+static bool loadLine(V473::HANDLE const hw, Card::Channel const& chan,
+		     UnitKind const kind, int const index,
+		     float const* const eu, size_t n)
+{
+    uint16_t raw[128];
+
+    if (kind == ukRamp) {
+	if (index >= 16 || rampToRaw(eu, raw, n))
+	    return false;
+
+	// Terminate the ramp if the file didn't.
+
+	if (n % 2 || n < 2)
+	    return false;
+	if (raw[n - 1]) {
+	    if (n > 126)
+		return false;
+	    raw[n] = raw[n - 2];
+	    raw[n + 1] = 0;
+	    n += 2;
+	}
+    } else if (toRaw(kind, eu, raw, n))
+	return false;
+
+    Card::LockType lock(hw);
+    uint16_t const cnt = (uint16_t) n;
+
+    switch (kind) {
+     case ukRamp:
+	return hw->setRamp(lock, chan, (uint16_t) index, 0, raw, cnt);
+
+     case ukOffset:
+	return hw->setOffsets(lock, chan, (uint16_t) index, raw, cnt);
+
+     case ukScale:
+	if (index < 1)
+	    return false;
+	return hw->setScaleFactors(lock, chan, (uint16_t) (index - 1), raw,
+				   cnt);
+
+     case ukDelay:
+	return hw->setDelays(lock, chan, (uint16_t) index, raw, cnt);
+
+     case ukFrequency:
+	return hw->setFrequencies(lock, chan, (uint16_t) index, raw, cnt);
+
+     case ukPhase:
+	return hw->setPhases(lock, chan, (uint16_t) index, raw, cnt);
+
+     default:
+	return false;
+    }
+}
+
+// Loads a channel's tables from a file of engineering-unit values.
+// Each line is a table name, the index of its first entry and the
+// values; ramp lines hold (value, microseconds) pairs. A "units"
+// line changes a kind's conversion. Lines starting with '#' are
+// comments.
+//
+//     units ramp 0.00122 0
+//     ramp 1  10.0 1000  10.0 5000  0.0 1000
+//     scales 1  1.0
+//     offsets 0  0.5 -0.5
+
+STATUS v473_load_eu(V473::HANDLE const hw, int const chan,
+		    char const* const path)
+{
+    if (!hw || !path) {
+	printf("usage: v473_load_eu handle, channel, path\n");
+	return ERROR;
+    }
+
+    FILE* const fp = fopen(path, "r");
+
+    if (!fp) {
+	printf("can't open %s\n", path);
+	return ERROR;
+    }
+
+    char line[2048];
+    int lineNo = 0;
+    STATUS result = OK;
+
+    try {
+	Card::Channel const ch(chan);
+
+	while (result == OK && fgets(line, sizeof(line), fp)) {
+	    char name[16];
+	    float scale, offset;
+	    int index, used;
+
+	    ++lineNo;
+	    if (sscanf(line, " %15s", name) != 1 || name[0] == '#')
+		continue;
+
+	    if (!strcmp(name, "units")) {
+		int kind;
+
+		if (sscanf(line, " units %15s %f %f", name, &scale,
+			   &offset) != 3 || (kind = findKind(name)) < 0 ||
+		    scale == 0.f) {
+		    printf("line %d: bad units\n", lineNo);
+		    result = ERROR;
+		} else
+		    setUnitConv((UnitKind) kind, scale, offset);
+		continue;
+	    }
+
+	    int const kind = findKind(name);
+
+	    if (kind < 0 || kind == ukTime ||
+		sscanf(line, " %15s %d%n", name, &index, &used) != 2 ||
+		index < 0) {
+		printf("line %d: unknown table or bad index\n", lineNo);
+		result = ERROR;
+		continue;
+	    }
+
+	    float eu[128];
+	    size_t n = 0;
+	    char* p = line + used;
+
+	    while (true) {
+		char* end;
+		double const v = strtod(p, &end);
+
+		if (end == p)
+		    break;
+		if (n == 128) {
+		    n = 0;
+		    break;
+		}
+		eu[n++] = (float) v;
+		p = end;
+	    }
+
+	    if (!n || !loadLine(hw, ch, (UnitKind) kind, index, eu, n)) {
+		printf("line %d: values don't fit, or the write failed\n",
+		       lineNo);
+		result = ERROR;
+	    }
+	}
+    }
+    catch (int16_t const& e) {
+	printf("line %d: error %d\n", lineNo, e);
+	result = ERROR;
+    }
+    catch (std::exception const& e) {
+	printf("line %d: %s\n", lineNo, e.what());
+	result = ERROR;
+    }
+    fclose(fp);
+    return result;
+}
+
+STATUS v473_units_show()
+{
+    printf("KIND         SCALE         OFFSET\n");
+    for (size_t ii = 0; ii < ukKinds; ++ii)
+	printf("%-11s  %-12g  %g\n", kindName[ii], conv[ii].scale,
+	       conv[ii].offset);
+    return OK;
+}
+
+// Converts a whole configuration of four channels, each with 15
+// full ramps and the five 32 entry tables, to raw words and back,
+// and reports the time per configuration.
+
+STATUS v473_units_bench(int const n)
+{
+    if (n <= 0 || n > 100000) {
+	printf("usage: v473_units_bench iterations\n");
+	return ERROR;
+    }
+
+    size_t const rampWords = 15 * 128;
+    size_t const tableWords = 32;
+    size_t const chanWords = rampWords + 5 * tableWords;
+    size_t const total = 4 * chanWords;
+    float* const eu = new float[total];
+    uint16_t* const raw = new uint16_t[total];
+
+    for (size_t ii = 0; ii < total; ++ii)
+	raw[ii] = (uint16_t) (ii * 2654435761u >> 20);
+
+    uint32_t const t0 = timeStamp();
+
+    for (int jj = 0; jj < n; ++jj)
+	for (size_t chan = 0; chan < 4; ++chan) {
+	    size_t const base = chan * chanWords;
+
+	    rampToEngineering(raw + base, eu + base, rampWords);
+	    for (size_t kk = 0; kk < 5; ++kk)
+		toEngineering((UnitKind) (ukOffset + kk),
+			      raw + base + rampWords + kk * tableWords,
+			      eu + base + rampWords + kk * tableWords,
+			      tableWords);
+	}
+
+    uint32_t const t1 = timeStamp();
+    size_t clipped = 0;
+
+    for (int jj = 0; jj < n; ++jj)
+	for (size_t chan = 0; chan < 4; ++chan) {
+	    size_t const base = chan * chanWords;
+
+	    clipped += rampToRaw(eu + base, raw + base, rampWords);
+	    for (size_t kk = 0; kk < 5; ++kk)
+		clipped += toRaw((UnitKind) (ukOffset + kk),
+				 eu + base + rampWords + kk * tableWords,
+				 raw + base + rampWords + kk * tableWords,
+				 tableWords);
+	}
+
+    uint32_t const t2 = timeStamp();
+
+    delete [] eu;
+    delete [] raw;
+    printf("%u words: to engineering units %u us, to raw %u us "
+	   "(%u clipped)\n", (unsigned) total, tbToUsec(t1 - t0) / n,
+	   tbToUsec(t2 - t1) / n, (unsigned) (clipped / n));
+    return OK;
+}
@@ -6,11 +6,35 @@
 #include <intLib.h>
 #include <taskLib.h>
 #include <rebootLib.h>
+#include <tickLib.h>
+#include <wdLib.h>
 #include <cstdio>
+#include <cstring>
 #include <cassert>
 
 extern "C" UINT16 sysIn16(UINT16*);
 extern "C" void sysOut16(UINT16*, UINT16);
+extern "C" void vxTimeBaseGet(UINT32*, UINT32*);
+
+// While polling for a command to complete, spin this many
+// microseconds before giving up the CPU between polls.
+
+int v473_spin_usec = 500;
+
+// A card reset must complete within this many milliseconds.
+
+int v473_reset_deadline = 2000;
+
+extern int v473_tclk_irq;
+
+// The interrupt sources the driver enables: the power supply errors,
+// mailbox done, tracking error, missing TCLK and calculation error,
+// plus the TCLK interrupt if the firmware has one.
+
+static uint16_t irqMaskValue()
+{
+    return (uint16_t) (0xd21f | v473_tclk_irq);
+}
 
 static void init() __attribute__((constructor));
 static void term() __attribute__((destructor));
@@ -20,11 +44,40 @@ static uint16_t lastMb = 0;
 static uint16_t lastCount = 0;
 static uint16_t lastDir = 0;
 
+// Scale factor, in 32.32 fixed-point, which converts time base ticks
+// to microseconds. It's calibrated when the module is loaded.
+
+static uint64_t tbScale = 0;
+
+// Measures the time base frequency against the system clock. This
+// takes a few clock ticks, so it's only done once.
+
+static void calibrateTimeBase()
+{
+    UINT32 hi, lo0, lo1;
+    unsigned long const t0 = tickGet();
+
+    while (tickGet() == t0)
+	;
+    vxTimeBaseGet(&hi, &lo0);
+
+    unsigned long const t1 = tickGet();
+
+    while (tickGet() - t1 < 2)
+	;
+    vxTimeBaseGet(&hi, &lo1);
+
+    uint64_t const freq = (uint64_t) (lo1 - lo0) * sysClkRateGet() / 2;
+
+    tbScale = freq ? (1000000ULL << 32) / freq : 0;
+}
+
 // Constructor function sets up the logger handle.
 
 static void init()
 {
     hLog = logRegister("V473", 0);
+    calibrateTimeBase();
 }
 
 static void term()
@@ -34,15 +87,41 @@ static void term()
 
 using namespace V473;
 
-bool Card::detect(Card::LockType const&)
+uint32_t V473::timeStamp()
+{
+    UINT32 hi, lo;
+
+    vxTimeBaseGet(&hi, &lo);
+    return lo;
+}
+
+uint32_t V473::tbToUsec(uint32_t const delta)
+{
+    return (uint32_t) ((delta * tbScale) >> 32);
+}
+
+bool Card::pollCommand(Card::LockType const&, uint32_t const tmo)
+{
+    uint32_t const start = timeStamp();
+
+    while (!(sysIn16(readWrite) & 2)) {
+	uint32_t const elapsed = tbToUsec(timeStamp() - start);
+
+	if (elapsed > tmo)
+	    return false;
+	if (elapsed > (uint32_t) v473_spin_usec)
+	    taskDelay(1);
+    }
+    return true;
+}
+
+bool Card::detect(Card::LockType const& lock)
 {
     sysOut16(dataBuffer, 0);
-    sysOut16(mailbox, 0xff00);
-    sysOut16(count, 1);
-    sysOut16(readWrite, 0);
-    taskDelay(2);
+    sendCommand(lock, cpModuleID, 1, 0);
 
-    if (sysIn16(readWrite) == 2 && sysIn16(count) == 1 &&
+    if (pollCommand(lock, 40000) && sysIn16(readWrite) == 2 &&
+	sysIn16(count) == 1 &&
 	sysIn16(dataBuffer) == 473) {
 	generateInterrupts(false);
 	sysOut16(irqSource, 0xffff);
@@ -52,75 +131,118 @@ bool Card::detect(Card::LockType const&)
 }
 
 Card::Card(uint8_t addr, uint8_t intVec) :
-    vecNum(intVec), lastCmdOkay(true)
+    vecNum(intVec), dipAddr(addr), fwVersion(0), fpgaVersion(0), stats(),
+    lastCmdOkay(true), cmdDone(true), cmdStart(0), busy(0),
+    cachedReads(false), shadowGen(0), resetTimer(0),
+    resetState(rsIdle), resetStart(0), resetDeadline(0), resetDelay(0),
+    tclkInterest(0), lastEvent(0), tclkPrimed(false), queuedWrites(0),
+    flushing(false)
 {
+    uint32_t const start = timeStamp();
     char* baseAddr;
 
-    if (ERROR == sysBusToLocalAdrs(VME_AM_STD_SUP_DATA,
-				   reinterpret_cast<char*>((uint32_t) addr << 16),
-				   &baseAddr))
-	throw std::runtime_error("illegal A24 VME address");
-
-    logInform1(hLog, "Looking for V473 at address %p", baseAddr);
-
-    // Compute the memory-mapped registers based upon the computed
-    // base address.
-
-    dataBuffer = reinterpret_cast<uint16_t*>(baseAddr);
-    mailbox = reinterpret_cast<uint16_t*>(baseAddr + 0x7ffa);
-    count = reinterpret_cast<uint16_t*>(baseAddr + 0x7ffc);
-    readWrite = reinterpret_cast<uint16_t*>(baseAddr + 0x7ffe);
-    resetAddr = reinterpret_cast<uint16_t*>(baseAddr + 0xfffe);
-    irqEnable = reinterpret_cast<uint16_t*>(baseAddr + 0x8000);
-    irqSource = reinterpret_cast<uint16_t*>(baseAddr + 0x8002);
-    irqMask = reinterpret_cast<uint16_t*>(baseAddr + 0x8004);
-    irqStatus = reinterpret_cast<uint16_t*>(baseAddr + 0x8006);
-    activeIrqSource = reinterpret_cast<uint16_t*>(baseAddr + 0x800a);
-
-    // Now that we think we're configured, let's check to see if we
-    // are, indeed, a V473.
-
-    Card::LockType lock(this);
-
-    if (!detect(lock))
-	throw std::runtime_error("VME A24 address doesn't refer to V473 "
-				 "hardware");
-
-    sysOut16(mailbox, 0xff01);
-    sysOut16(count, 1);
-    sysOut16(readWrite, 0);
-    taskDelay(2);
-
-    uint16_t const firmware = sysIn16(dataBuffer);
-
-    sysOut16(mailbox, 0xff02);
-    sysOut16(count, 1);
-    sysOut16(readWrite, 0);
-    taskDelay(2);
-
-    uint16_t const fpga = sysIn16(dataBuffer);
-
-    logInform5(hLog, "V473: Found hardware -- addr %p, Firmware v%d.%d, "
-	       "FPGA v%d.%d", dataBuffer, firmware >> 4, firmware & 0xf,
-	       fpga >> 4, fpga & 0xf);
-
-    // Now that we know we're a V473, we can attach the interrupt
-    // handler.
-
-    if (OK != intConnect(INUM_TO_IVEC((int) intVec),
-			 reinterpret_cast<VOIDFUNCPTR>(gblIntHandler),
-			 reinterpret_cast<int>(this)))
-	throw std::runtime_error("cannot connect V473 hardware to interrupt "
-				 "vector");
+    shadowInvalidate();
+    for (size_t ii = 0; ii < 4; ++ii) {
+	upload[ii].state = usIdle;
+	upload[ii].total = upload[ii].written = upload[ii].skipped = 0;
+	for (size_t jj = 0; jj < 16; ++jj)
+	    rampSlot[ii][jj].hash = rampSlot[ii][jj].lastUse = 0;
+	rampClock[ii] = 0;
+	rampStats[ii].hits = rampStats[ii].misses = rampStats[ii].evictions = 0;
+    }
+    for (size_t ii = 0; ii < maxTclkWatches; ++ii)
+	tclkWatch[ii].func = 0;
+    for (size_t ii = 0; ii < 32; ++ii)
+	levelStarts[ii] = lastCounters[ii] = 0;
+    for (size_t ii = 0; ii < 256; ++ii)
+	eventsSeen[ii] = 0;
+
+    // The address and vector are claimed before the hardware is
+    // touched. The destructor won't run if we throw, so they're
+    // given back, and the watchdog deleted, here on failure. Nothing
+    // after the interrupt is connected can fail.
+
+    reserveCard(this);
+    try {
+	char* const busAddr = reinterpret_cast<char*>((uint32_t) addr << 16);
+
+	if (ERROR == sysBusToLocalAdrs(VME_AM_STD_SUP_DATA, busAddr,
+				       &baseAddr))
+	    throw std::runtime_error("illegal A24 VME address");
+
+	logInform1(hLog, "Looking for V473 at address %p", baseAddr);
+
+	// Compute the memory-mapped registers based upon the computed
+	// base address.
+
+	dataBuffer = reinterpret_cast<uint16_t*>(baseAddr);
+	mailbox = reinterpret_cast<uint16_t*>(baseAddr + 0x7ffa);
+	count = reinterpret_cast<uint16_t*>(baseAddr + 0x7ffc);
+	readWrite = reinterpret_cast<uint16_t*>(baseAddr + 0x7ffe);
+	resetAddr = reinterpret_cast<uint16_t*>(baseAddr + 0xfffe);
+	irqEnable = reinterpret_cast<uint16_t*>(baseAddr + 0x8000);
+	irqSource = reinterpret_cast<uint16_t*>(baseAddr + 0x8002);
+	irqMask = reinterpret_cast<uint16_t*>(baseAddr + 0x8004);
+	irqStatus = reinterpret_cast<uint16_t*>(baseAddr + 0x8006);
+	activeIrqSource = reinterpret_cast<uint16_t*>(baseAddr + 0x800a);
+
+	// Now that we think we're configured, let's check to see if we
+	// are, indeed, a V473.
+
+	Card::LockType lock(this);
+
+	if (!detect(lock))
+	    throw std::runtime_error("VME A24 address doesn't refer to V473 "
+				     "hardware");
+
+	sendCommand(lock, cpFirmwareVersion, 1, 0);
+	if (!pollCommand(lock, 40000))
+	    throw std::runtime_error("V473 didn't report its firmware "
+				     "version");
+	fwVersion = sysIn16(dataBuffer);
+
+	sendCommand(lock, cpFpgaVersion, 1, 0);
+	if (!pollCommand(lock, 40000))
+	    throw std::runtime_error("V473 didn't report its FPGA version");
+	fpgaVersion = sysIn16(dataBuffer);
+
+	logInform5(hLog, "V473: Found hardware -- addr %p, Firmware v%d.%d, "
+		   "FPGA v%d.%d", dataBuffer, fwVersion >> 4, fwVersion & 0xf,
+		   fpgaVersion >> 4, fpgaVersion & 0xf);
+
+	// Now that we know we're a V473, we can create the reset
+	// watchdog and attach the interrupt handler.
+
+	if (!(resetTimer = wdCreate()))
+	    throw std::runtime_error("couldn't create reset watchdog");
+
+	if (OK != intConnect(INUM_TO_IVEC((int) intVec),
+			     reinterpret_cast<VOIDFUNCPTR>(gblIntHandler),
+			     reinterpret_cast<int>(this)))
+	    throw std::runtime_error("cannot connect V473 hardware to "
+				     "interrupt vector");
+    }
+    catch (...) {
+	if (resetTimer)
+	    wdDelete(resetTimer);
+	unregisterCard(this);
+	throw;
+    }
 
     sysOut16(irqSource, 0xffff);
-    sysOut16(irqMask, 0xd21f);
+    sysOut16(irqMask, irqMaskValue());
     sysOut16(irqStatus, intVec);
-    taskDelay(20);
+
+    stats.probeTime = tbToUsec(timeStamp() - start);
+    registerCard(this);
 }
 
 Card::~Card()
 {
+    unregisterCard(this);
+    waitTclkPass();
+    wdCancel(resetTimer);
+    wdDelete(resetTimer);
     generateInterrupts(false);
 #if VX_VERSION > 55
     intDisconnect(INUM_TO_IVEC((int) vecNum),
@@ -129,22 +251,134 @@ Card::~Card()
 #endif
 }
 
-void Card::reset(Card::LockType const& lock)
+bool Card::startReset(Card::LockType const&)
 {
+    if (resetState == rsWaitReady || resetState == rsProbing)
+	return true;
+
+    // Give the card two ticks to start its reset before we check
+    // on it; the state machine takes it from there.
+
+    generateInterrupts(false);
+    shadowInvalidate();
+    tclkPrimed = false;
+    resetStart = timeStamp();
+    resetDeadline = tickGet() + v473_reset_deadline * sysClkRateGet() / 1000;
+    resetDelay = 2;
+    resetState = rsWaitReady;
     *resetAddr = 0;
+    if (OK != wdStart(resetTimer, resetDelay,
+		      reinterpret_cast<FUNCPTR>(gblResetHandler),
+		      reinterpret_cast<int>(this))) {
+	resetFinished(rsFailed);
+	return false;
+    }
+    return true;
+}
+
+bool Card::waitReset(int const tmo)
+{
+    vwpp::v3_0::IntLock iLock;
 
-    // Loop until the hardware responds.
+    while (resetState == rsWaitReady || resetState == rsProbing)
+	if (!resetDone.wait(iLock, tmo))
+	    return false;
+    return resetState == rsIdle;
+}
 
-    do {
-	taskDelay(2);
-    } while (!detect(lock));
+// The state machine's last step runs at the deadline, so the wait
+// allows a couple of ticks more for it to record the outcome.
 
-    // Re-enable interrupts.
+bool Card::reset(Card::LockType const& lock)
+{
+    return startReset(lock) &&
+	waitReset(v473_reset_deadline + 2000 / sysClkRateGet() + 1);
+}
 
-    sysOut16(irqStatus, vecNum);
-    sysOut16(irqSource, 0xffff);
-    sysOut16(irqMask, 0xd21f);
-    generateInterrupts(true);
+void Card::gblResetHandler(Card* const ptr)
+{
+    ptr->resetStep();
+}
+
+// Advances the reset state machine. This runs from the watchdog
+// timer (i.e. at interrupt level), so it only touches registers and
+// never blocks. Rather than sending a module-ID probe on every tick,
+// it waits for the card to report an idle mailbox and only then
+// probes it once. The polling interval doubles each time the card
+// doesn't answer.
+
+void Card::resetStep()
+{
+    switch (resetState) {
+     case rsWaitReady:
+	if (sysIn16(readWrite) & 2) {
+	    sysOut16(dataBuffer, 0);
+	    sysOut16(mailbox, cpModuleID);
+	    sysOut16(count, 1);
+	    sysOut16(readWrite, 0);
+	    resetState = rsProbing;
+	    if (OK != wdStart(resetTimer, 1,
+			      reinterpret_cast<FUNCPTR>(gblResetHandler),
+			      reinterpret_cast<int>(this)))
+		resetFinished(rsFailed);
+	    return;
+	}
+	break;
+
+     case rsProbing:
+	if (sysIn16(readWrite) == 2 && sysIn16(count) == 1 &&
+	    sysIn16(dataBuffer) == 473) {
+
+	    // The card is back. Re-arm its interrupts.
+
+	    sysOut16(irqStatus, vecNum);
+	    sysOut16(irqSource, 0xffff);
+	    sysOut16(irqMask, irqMaskValue());
+	    generateInterrupts(true);
+	    resetFinished(rsIdle);
+	    return;
+	}
+	resetState = rsWaitReady;
+	break;
+
+     default:
+	return;
+    }
+
+    // The next poll is never later than the deadline, so a card that
+    // doesn't come back fails on time.
+
+    long const left = (long) (resetDeadline - tickGet());
+
+    if (left <= 0) {
+	resetFinished(rsFailed);
+	return;
+    }
+
+    int const maxDelay = sysClkRateGet() / 4;
+
+    resetDelay = resetDelay * 2 < maxDelay ? resetDelay * 2 : maxDelay;
+    if (resetDelay > left)
+	resetDelay = (int) left;
+    if (OK != wdStart(resetTimer, resetDelay,
+		      reinterpret_cast<FUNCPTR>(gblResetHandler),
+		      reinterpret_cast<int>(this)))
+	resetFinished(rsFailed);
+}
+
+void Card::resetFinished(ResetState const state)
+{
+    uint32_t const elapsed = tbToUsec(timeStamp() - resetStart);
+
+    ++stats.resetCount;
+    if (state != rsIdle)
+	++stats.resetFailures;
+    stats.lastResetTime = elapsed;
+    if (elapsed > stats.maxResetTime)
+	stats.maxResetTime = elapsed;
+    cmdDone = true;
+    resetState = state;
+    resetDone.wakeAll();
 }
 
 void Card::gblIntHandler(Card* const ptr)
@@ -207,8 +441,11 @@ void Card::intHandler()
 	handlePSTrackingErr();
     if (sts & 0x10) {
 	lastCmdOkay = !(sts & 0x8000);
+	cmdDone = true;
 	intDone.wakeOne();
     }
+    if (sts & v473_tclk_irq)
+	tclkNotify();
     if (sts & 0x8)
 	handlePS3Err();
     if (sts & 0x4)
@@ -224,40 +461,67 @@ void Card::generateInterrupts(bool flg)
     sysOut16(irqEnable, flg ? 3 : 2);
 }
 
-// Sends the mailbox value, the word count and the READ command to the
-// hardware. This function assumes the data buffer has been preloaded
-// with the appropriate data. Returns true if everything is
-// successful.
+// Loads the mailbox value, the word count and the direction into the
+// transaction registers. The card starts working on the command as
+// soon as the direction register is written, so this function
+// returns without waiting for the result. Returns false if the card
+// can't accept a command.
 
-bool Card::readProperty(Card::LockType const&, uint16_t const mb, size_t const n)
+bool Card::sendCommand(Card::LockType const&, uint16_t const mb,
+		       size_t const n, uint16_t const dir)
 {
+    // If the card is being reset, wait for it to finish. A card
+    // whose last reset failed doesn't accept commands.
+
+    if (resetState != rsIdle && !waitReset(v473_reset_deadline))
+	return false;
+
+    cmdDone = false;
+    cmdStart = timeStamp();
     sysOut16(mailbox, lastMb = mb);
     sysOut16(count, lastCount = (uint16_t) n);
-    sysOut16(readWrite, lastDir = 0);
+    sysOut16(readWrite, lastDir = dir);
+    return true;
+}
 
+// Waits for the command started by sendCommand() to complete. The
+// interrupt handler sets `cmdDone` so a completion that arrives
+// before we start waiting isn't lost.
+
+bool Card::waitCommand(Card::LockType const&)
+{
     // Wait up to 40 milliseconds for a response.
 
     vwpp::v3_0::IntLock iLock;
 
-    return intDone.wait(iLock, 40) && lastCmdOkay;
+    while (!cmdDone)
+	if (!intDone.wait(iLock, 40)) {
+	    busy += timeStamp() - cmdStart;
+	    return false;
+	}
+    busy += timeStamp() - cmdStart;
+    return lastCmdOkay;
+}
+
+// Sends the mailbox value, the word count and the READ command to the
+// hardware. This function assumes the data buffer has been preloaded
+// with the appropriate data. Returns true if everything is
+// successful.
+
+bool Card::readProperty(Card::LockType const& lock, uint16_t const mb,
+			size_t const n)
+{
+    return sendCommand(lock, mb, n, 0) && waitCommand(lock);
 }
 
 // Sends the mailbox value, the word count and the SET command to the
 // hardware. When this function returns, the data buffer will hold the
 // return value.
 
-bool Card::setProperty(Card::LockType const&, uint16_t const mb,
+bool Card::setProperty(Card::LockType const& lock, uint16_t const mb,
 		       size_t const n)
 {
-    sysOut16(mailbox, lastMb = mb);
-    sysOut16(count, lastCount = (uint16_t) n);
-    sysOut16(readWrite, lastDir = 1);
-
-    // Wait up to 40 milliseconds for a response.
-
-    vwpp::v3_0::IntLock iLock;
-
-    return intDone.wait(iLock, 40) && lastCmdOkay;
+    return sendCommand(lock, mb, n, 1) && waitCommand(lock);
 }
 
 bool Card::readBank(Card::LockType const& lock, Channel const& chan,
@@ -265,12 +529,17 @@ bool Card::readBank(Card::LockType const& lock, Channel const& chan,
 		    uint16_t* const ptr, uint16_t const n)
 {
     IntLevel const il(start, prop);
+    uint16_t const addr = GEN_ADDR(chan, il);
+
+    if (cachedReads && shadowLoad(addr, ptr, n))
+	return true;
 
     assert(sysIn16(readWrite) & 2);
 
-    if (readProperty(lock, GEN_ADDR(chan, il), n)) {
+    if (readProperty(lock, addr, n)) {
 	for (uint16_t ii = 0; ii < n; ++ii)
 	    ptr[ii] = sysIn16(dataBuffer + ii);
+	shadowStore(addr, ptr, n);
 	return true;
     } else
 	return false;
@@ -281,23 +550,221 @@ bool Card::writeBank(Card::LockType const& lock, Channel const& chan,
 		     uint16_t const* const ptr, uint16_t const n)
 {
     IntLevel const il(start, prop);
+    uint16_t const addr = GEN_ADDR(chan, il);
+
+    lintWrite(lock, chan, (uint16_t) (il.prop() + il.level()), ptr, n);
+    if (queuedWrites && !flushing)
+	supersedeQueued(addr, ptr, n);
 
     assert(sysIn16(readWrite) & 2);
 
     for (uint16_t ii = 0; ii < n; ++ii)
 	sysOut16(dataBuffer + ii, ptr[ii]);
-    return setProperty(lock, GEN_ADDR(chan, il), n);
+    if (setProperty(lock, addr, n)) {
+	shadowStore(addr, ptr, n);
+	return true;
+    }
+
+    // We don't know how much of a failed write made it to the card.
+
+    shadowDiscard(addr, n);
+    return false;
+}
+
+// Finds the part of the configuration copy which holds `n` words
+// starting at card address `addr`. Returns 0 if the range isn't
+// entirely inside one of the shadowed regions.
+
+uint16_t* Card::shadowLookup(uint16_t const addr, uint16_t const n,
+			     uint32_t*& valid, size_t& first)
+{
+    if (addr < shadowTrigBase) {
+	size_t const chan = addr >> 12;
+	size_t const offset = addr & 0xfff;
+
+	if (chan < 4 && offset + n <= shadowChanWords) {
+	    valid = validChan[chan];
+	    first = offset;
+	    return shadowChan[chan];
+	}
+    } else if (addr + n <= shadowTrigBase + shadowTrigWords) {
+	valid = validTrig;
+	first = addr - shadowTrigBase;
+	return shadowTrig;
+    }
+    return 0;
+}
+
+void Card::shadowStore(uint16_t const addr, uint16_t const* const ptr,
+		       uint16_t const n)
+{
+    uint32_t* valid;
+    size_t first;
+    uint16_t* const base = shadowLookup(addr, n, valid, first);
+
+    ++shadowGen;
+    if (base)
+	for (size_t ii = 0; ii < n; ++ii) {
+	    base[first + ii] = ptr[ii];
+	    valid[(first + ii) / 32] |= 1u << ((first + ii) % 32);
+	}
+}
+
+void Card::shadowDiscard(uint16_t const addr, uint16_t const n)
+{
+    uint32_t* valid;
+    size_t first;
+
+    ++shadowGen;
+    if (shadowLookup(addr, n, valid, first))
+	for (size_t ii = first; ii < first + n; ++ii)
+	    valid[ii / 32] &= ~(1u << (ii % 32));
+}
+
+// Copies a range out of the configuration copy. Returns false,
+// leaving the buffer untouched, if any word of the range is unknown.
+
+bool Card::shadowLoad(uint16_t const addr, uint16_t* const ptr,
+		      uint16_t const n)
+{
+    uint32_t* valid;
+    size_t first;
+    uint16_t const* const base = shadowLookup(addr, n, valid, first);
+
+    if (!base)
+	return false;
+
+    for (size_t ii = first; ii < first + n; ++ii)
+	if (!(valid[ii / 32] & (1u << (ii % 32))))
+	    return false;
+
+    for (size_t ii = 0; ii < n; ++ii)
+	ptr[ii] = base[first + ii];
+    return true;
+}
+
+void Card::shadowInvalidate()
+{
+    ++shadowGen;
+    for (size_t chan = 0; chan < 4; ++chan)
+	for (size_t ii = 0; ii < shadowChanWords / 32; ++ii)
+	    validChan[chan][ii] = 0;
+    for (size_t ii = 0; ii < shadowTrigWords / 32; ++ii)
+	validTrig[ii] = 0;
+}
+
+// Returns true if writing the buffer to `addr` could change the
+// card's contents, i.e. the range isn't entirely known or it holds
+// different values.
+
+bool Card::shadowDiffers(uint16_t const addr, uint16_t const* const ptr,
+			 uint16_t const n)
+{
+    uint16_t tmp[128];
+
+    return n > 128 || !shadowLoad(addr, tmp, n) ||
+	memcmp(tmp, ptr, n * sizeof(uint16_t)) != 0;
+}
+
+bool Card::uploadRamps(Channel const& chan, uint16_t const ramp,
+		       uint16_t const offset, uint16_t const* const ptr,
+		       size_t const n, int const tmo)
+{
+    size_t const first = (ramp << 7) + 2 * offset;
+    size_t const end = first + n;
+
+    if (ramp >= 16 || offset >= 64 || end > cpRampMap)
+	throw std::logic_error("ramp data extends past the last ramp");
+
+    UploadProgress& prog = upload[chan];
+    size_t pos = first;
+    size_t len = std::min(end, (pos | 0x7f) + 1) - pos;
+    bool changed = true;
+    uint32_t gen = 0;
+
+    {
+	LockType lock(this, tmo);
+
+	lintWrite(lock, chan, (uint16_t) first, ptr, n);
+	if (queuedWrites)
+	    supersedeQueued(GEN_ADDR(chan, cpRampTable) + first, ptr, n);
+	prog.state = n ? usActive : usIdle;
+	prog.total = (uint16_t) n;
+	prog.written = prog.skipped = 0;
+    }
+
+    while (pos < end) {
+	LockType lock(this, tmo);
+	uint16_t const* const src = ptr + (pos - first);
+	uint16_t const addr =
+	    GEN_ADDR(chan, IntLevel(pos & 0x7f, ChannelProperty(pos & ~0x7f)));
+	size_t const next = pos + len;
+	size_t const nextLen = std::min(end, next + 128) - next;
+
+	// The comparison made while the previous ramp was being
+	// stored is stale if the configuration copy changed since.
+
+	if (!changed && gen != shadowGen)
+	    changed = shadowDiffers(addr, src, len);
+
+	if (changed) {
+	    assert(sysIn16(readWrite) & 2);
+
+	    for (size_t ii = 0; ii < len; ++ii)
+		sysOut16(dataBuffer + ii, src[ii]);
+	    if (!sendCommand(lock, addr, len, 1)) {
+		prog.state = usFailed;
+		return false;
+	    }
+	}
+
+	// Stage the next ramp while the card works on this one.
+
+	bool const nextChanged = next < end &&
+	    shadowDiffers((uint16_t) (addr + len), src + len, nextLen);
+
+	if (changed) {
+	    if (!waitCommand(lock)) {
+		shadowDiscard(addr, len);
+		prog.state = usFailed;
+		return false;
+	    }
+	    shadowStore(addr, src, len);
+	    prog.written += len;
+	} else
+	    prog.skipped += len;
+
+	gen = shadowGen;
+	changed = nextChanged;
+	pos = next;
+	len = nextLen;
+	if (pos >= end)
+	    prog.state = usIdle;
+    }
+    return true;
 }
 
 bool Card::setTriggerMap(Card::LockType const& lock, uint16_t const intLvl,
 			 uint8_t const events[8], size_t const n)
 {
     if (n <= 8) {
+	uint16_t const addr = 0x4000 + (intLvl << 3);
+	uint16_t tmp[8];
+
 	assert(sysIn16(readWrite) & 2);
 
 	for (size_t ii = 0; ii < 8; ++ii)
-	    sysOut16(dataBuffer + ii, ii < n ? events[ii] : 0x00fe);
-	return setProperty(lock, 0x4000 + (intLvl << 3), 8);
+	    tmp[ii] = ii < n ? events[ii] : 0x00fe;
+	if (queuedWrites && !flushing)
+	    supersedeQueued(addr, tmp, 8);
+	for (size_t ii = 0; ii < 8; ++ii)
+	    sysOut16(dataBuffer + ii, tmp[ii]);
+	if (setProperty(lock, addr, 8)) {
+	    shadowStore(addr, tmp, 8);
+	    return true;
+	}
+	shadowDiscard(addr, 8);
+	return false;
     } else
 	throw std::logic_error("# of TCLK events cannot exceed 8");
 }
@@ -396,6 +863,23 @@ bool Card::getPowerSupplyStatus(Card::LockType const& lock, uint16_t const chan,
 	return false;
 }
 
+bool Card::startPowerSupplyStatus(Card::LockType const& lock,
+				  Channel const& chan)
+{
+    return sendCommand(lock, GEN_ADDR(chan, cpPSStatus), 1, 0);
+}
+
+bool Card::finishRead(Card::LockType const& lock, uint16_t* const ptr,
+		      uint16_t const n)
+{
+    if (waitCommand(lock)) {
+	for (uint16_t ii = 0; ii < n; ++ii)
+	    ptr[ii] = sysIn16(dataBuffer + ii);
+	return true;
+    } else
+	return false;
+}
+
 bool Card::getLastTclkEvent(Card::LockType const& lock, uint16_t* ptr)
 {
     assert(sysIn16(readWrite) & 2);
@@ -557,6 +1041,23 @@ V473::HANDLE v473_create(int addr, int intVec)
 	V473::HANDLE const ptr = new Card(addr, intVec);
 
 	ptr->generateInterrupts(true);
+
+	// Make sure the card's interrupts reach us by doing one
+	// interrupt-driven read.
+
+	uint16_t id;
+	bool okay;
+
+	{
+	    Card::LockType lock(ptr);
+
+	    okay = ptr->getModuleId(lock, &id);
+	}
+
+	if (!okay) {
+	    delete ptr;
+	    throw std::runtime_error("V473 isn't generating interrupts");
+	}
 	return ptr;
     }
     catch (std::exception const& e) {
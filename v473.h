@@ -1,10 +1,14 @@
 #include <vxWorks.h>
+#include <wdLib.h>
+#include <semLib.h>
 #include <stdexcept>
 #include <vwpp-3.0.h>
 #include <mooc++-4.6.h>
 
 namespace V473 {
 
+    struct ChannelModel;
+
     class Card {
 	vwpp::v3_0::Mutex mutex;
 
@@ -28,11 +32,297 @@ namespace V473 {
 	    operator size_t() const { return value; }
 	};
 
+	// Counters and timings kept for each card. Times are in
+	// microseconds.
+
+	struct Statistics {
+	    uint32_t probeTime;
+	    uint32_t resetCount;
+	    uint32_t resetFailures;
+	    uint32_t lastResetTime;
+	    uint32_t maxResetTime;
+	};
+
+	// States of the reset sequence. A reset is started by
+	// startReset() and is then advanced by a watchdog timer, so the
+	// caller doesn't have to wait for it.
+
+	enum ResetState { rsIdle, rsWaitReady, rsProbing, rsFailed };
+
+	// Progress of the most recent F(t) upload to a channel. The
+	// counts are in words.
+
+	enum UploadState { usIdle, usActive, usFailed };
+
+	struct UploadProgress {
+	    UploadState state;
+	    uint16_t total;
+	    uint16_t written;
+	    uint16_t skipped;
+	};
+
+	// Collects a new configuration for an interrupt level. Any of
+	// the channels' ramp, scale factor, offset, delay, frequency
+	// and phase may be staged; whatever isn't staged is copied
+	// from the level's current configuration by commit().
+
+	class Stage {
+	    friend class Card;
+
+	    enum {
+		sfRamp = 1, sfScale = 2, sfOffset = 4,
+		sfDelay = 8, sfFreq = 16, sfPhase = 32
+	    };
+
+	    struct Entry {
+		unsigned fields;
+		uint16_t ramp[128];
+		uint16_t rampLen;
+		uint16_t scale;
+		uint16_t offset;
+		uint16_t delay;
+		uint16_t freq;
+		uint16_t phase;
+	    };
+
+	    uint16_t const intLvl;
+	    Entry entry[4];
+
+	 public:
+	    explicit Stage(uint16_t const lvl) :
+		intLvl(lvl < 32 ? lvl : throw int16_t(ERR_BADSLOT))
+	    {
+		clear();
+	    }
+
+	    void clear()
+	    {
+		for (size_t ii = 0; ii < 4; ++ii)
+		    entry[ii].fields = 0;
+	    }
+
+	    uint16_t level() const { return intLvl; }
+
+	    void setRamp(Channel const& chan, uint16_t const* const ptr,
+			 size_t const n)
+	    {
+		if (n > 128)
+		    throw std::logic_error("ramp longer than 64 segments");
+		for (size_t ii = 0; ii < n; ++ii)
+		    entry[chan].ramp[ii] = ptr[ii];
+		entry[chan].rampLen = (uint16_t) n;
+		entry[chan].fields |= sfRamp;
+	    }
+
+	    void setScaleFactor(Channel const& chan, uint16_t const v)
+	    {
+		entry[chan].scale = v;
+		entry[chan].fields |= sfScale;
+	    }
+
+	    void setOffset(Channel const& chan, uint16_t const v)
+	    {
+		entry[chan].offset = v;
+		entry[chan].fields |= sfOffset;
+	    }
+
+	    void setDelay(Channel const& chan, uint16_t const v)
+	    {
+		entry[chan].delay = v;
+		entry[chan].fields |= sfDelay;
+	    }
+
+	    void setFrequency(Channel const& chan, uint16_t const v)
+	    {
+		entry[chan].freq = v;
+		entry[chan].fields |= sfFreq;
+	    }
+
+	    void setPhase(Channel const& chan, uint16_t const v)
+	    {
+		entry[chan].phase = v;
+		entry[chan].fields |= sfPhase;
+	    }
+	};
+
+	// Describes a committed configuration: the interrupt level
+	// that now holds it and, once it's been seen playing, the TCLK
+	// event that started it and when it was seen. Times are time
+	// base ticks (see timeStamp().)
+
+	struct CommitResult {
+	    uint16_t level;
+	    uint16_t event;
+	    bool switched;
+	    bool confirmed;
+	    uint32_t switchTime;
+	    uint32_t effectTime;
+	};
+
+	// Conditions that TCLK watchers and waiters can ask for: an
+	// interrupt level starting to play, or a TCLK event arriving.
+	// Callbacks run in the TCLK watcher task, without the card
+	// locked, and are passed the condition and the level or event.
+
+	enum TclkCondition { tcLevelStarted, tcEventSeen };
+
+	typedef void (*TclkCallback)(Card*, void*, TclkCondition, uint16_t);
+
+	// TCLK events 0xfe and 0xff don't occur, so they mark the
+	// unused entries of the trigger map.
+
+	static bool unusedEvent(uint16_t const ev)
+	{
+	    return (ev & 0xff) >= 0xfe;
+	}
+
+	// The state of a channel's waveform generator: the segment of
+	// the ramp being played and the time left in it. A channel
+	// that's on segment 0 with no time left isn't playing a ramp.
+
+	struct ChannelActivity {
+	    uint16_t segment;
+	    uint16_t timeRemaining;
+
+	    bool idle() const { return segment == 0 && timeRemaining == 0; }
+	};
+
+	// The signature of the functions that write a range of a table
+	// or map, e.g. setOffsets() or setRampMap().
+
+	typedef bool (Card::*TableWriter)(LockType const&, Channel const&,
+					  uint16_t, uint16_t const*, uint16_t);
+
+	// Counters kept by the ramp slot cache for each channel.
+
+	struct RampCacheStats {
+	    uint32_t hits;
+	    uint32_t misses;
+	    uint32_t evictions;
+	};
+
+	// The state of a group of channels that is double-buffered with
+	// playFrame(). `level` is the interrupt level that holds the
+	// group's latest frame. A frame that was replaced before it was
+	// seen playing counts as `replaced`. `prev` describes the frame
+	// before the latest one. `writeTime` is how long the latest frame
+	// took to write, in time base ticks, not counting the wait for
+	// the frame before it.
+
+	struct PingPong {
+	    uint16_t level;
+	    uint16_t chanMask;
+	    CommitResult last;
+	    CommitResult prev;
+	    uint32_t writeTime;
+	    uint32_t frames;
+	    uint32_t confirmed;
+	    uint32_t replaced;
+	    uint32_t failed;
+	};
+
+	// A sine wave for an interrupt level, for planSweeps(). The
+	// frequency moves from `startFreq` to `endFreq` over `ticks`.
+	// Frequencies are in 1/65536ths of the 100 kHz tick rate, so a
+	// frequency word is the phase advance per tick, and phases are
+	// in 1/65536ths of a cycle. If `continuous` is set, the wave
+	// starts at the phase where the previous sweep of the plan ends,
+	// instead of at `phase`.
+
+	struct SineSweep {
+	    uint16_t level;
+	    uint16_t startFreq;
+	    uint16_t endFreq;
+	    uint16_t phase;
+	    uint32_t ticks;
+	    bool continuous;
+	};
+
+	// Frequency and phase tables, and the map entries of the levels
+	// in `levels` (bit N is level N), packed by planSweeps(). `mode`
+	// is the SineMode for the channel.
+
+	struct SweepTables {
+	    uint16_t freq[32];
+	    uint16_t phase[32];
+	    uint16_t freqMap[32];
+	    uint16_t phaseMap[32];
+	    uint16_t freqs;
+	    uint16_t phases;
+	    uint16_t mode;
+	    uint32_t levels;
+	};
+
+	// What verifySweep() read back from the channel.
+
+	struct SweepCheck {
+	    uint16_t level;
+	    uint16_t activeFreq;
+	    uint16_t activePhase;
+	    uint16_t finalFreq;
+	    uint16_t finalPhase;
+	    bool planned;
+	    bool matches;
+	};
+
+	// A scale factor and offset for an interrupt level, for
+	// assignScaling().
+
+	struct LevelScaling {
+	    uint16_t level;
+	    uint16_t scale;
+	    uint16_t offset;
+	};
+
+	// The number of interrupt levels that use each scale factor
+	// and offset slot, after assignScaling(), and the number of
+	// writes it made.
+
+	struct ScalingSlots {
+	    uint8_t scaleRefs[32];
+	    uint8_t offsetRefs[32];
+	    uint16_t writes;
+	};
+
      private:
 	uint8_t const vecNum;
+	uint8_t const dipAddr;
+	uint16_t fwVersion;
+	uint16_t fpgaVersion;
+	Statistics stats;
 
 	vwpp::v3_0::Event<> intDone;
 	bool volatile lastCmdOkay;
+	bool volatile cmdDone;
+	uint32_t cmdStart;
+	uint32_t busy;
+
+	// The driver's copy of the card's configuration: the ramp
+	// tables, maps and tables of each channel, and the trigger map.
+	// Each word has a valid bit which is set once the word has been
+	// written to, or read from, the card.
+
+	enum {
+	    shadowChanWords = 0x980,
+	    shadowTrigBase = 0x4000,
+	    shadowTrigWords = 0x100
+	};
+
+	uint16_t shadowChan[4][shadowChanWords];
+	uint16_t shadowTrig[shadowTrigWords];
+	uint32_t validChan[4][shadowChanWords / 32];
+	uint32_t validTrig[shadowTrigWords / 32];
+	bool cachedReads;
+	uint32_t shadowGen;
+
+	UploadProgress upload[4];
+
+	WDOG_ID resetTimer;
+	vwpp::v3_0::Event<> resetDone;
+	ResetState volatile resetState;
+	uint32_t resetStart;
+	unsigned long resetDeadline;
+	int resetDelay;
 
 	uint16_t* dataBuffer;
 	uint16_t* mailbox;
@@ -117,7 +407,8 @@ namespace V473 {
 
 	 public:
 	    IntLevel(size_t const v, ChannelProperty const& p) :
-		value(v < 32 || (p == cpTriggerMap && v < 256) ?
+		value(v < 32 || (p == cpTriggerMap && v < 256) ||
+		      (p < cpRampMap && v < 128) ?
 		      v : throw int16_t(ERR_BADSLOT)),
 		pvalue(p)
 	    {}
@@ -148,6 +439,20 @@ namespace V473 {
 	bool readProperty(LockType const&, uint16_t, size_t);
 	bool setProperty(LockType const&, uint16_t, size_t);
 
+	// The two halves of a mailbox transaction. sendCommand() loads
+	// the registers and returns immediately; waitCommand() blocks
+	// until the card's "mailbox done" interrupt arrives (or the
+	// command times out.)
+
+	bool sendCommand(LockType const&, uint16_t, size_t, uint16_t);
+	bool waitCommand(LockType const&);
+
+	// Before the interrupt handler is attached, commands are
+	// completed by polling the transaction registers. The argument
+	// is the longest time, in microseconds, to wait.
+
+	bool pollCommand(LockType const&, uint32_t);
+
 	// Many properties in the V473 are in banks of 32 values.
 	// These functions grab any subset of a bank of values. If the
 	// range is invalid, a logic_error exception will be thrown.
@@ -157,9 +462,110 @@ namespace V473 {
 	bool writeBank(LockType const&, Channel const&, ChannelProperty,
 		       uint16_t, uint16_t const*, uint16_t);
 
+	// Maintain the copy of the card's configuration. Addresses
+	// outside the shadowed regions are ignored.
+
+	uint16_t* shadowLookup(uint16_t, uint16_t, uint32_t*&, size_t&);
+	void shadowStore(uint16_t, uint16_t const*, uint16_t);
+	void shadowDiscard(uint16_t, uint16_t);
+	bool shadowLoad(uint16_t, uint16_t*, uint16_t);
+	void shadowInvalidate();
+	bool shadowDiffers(uint16_t, uint16_t const*, uint16_t);
+
+	// Rejects, by throwing ERR_BADSET, a write that would make an
+	// interrupt level overflow the DAC or exceed the slew limit
+	// (see lint.cpp.) It does nothing unless `v473_lint` is set.
+
+	void lintWrite(LockType const&, Channel const&, uint16_t,
+		       uint16_t const*, size_t);
+
+	bool commitStage(LockType const&, Stage const&, CommitResult&);
+	bool findUsedLevels(LockType const&, uint16_t*, bool*);
+
+	// The ramp slot cache. Each of a channel's 15 ramp slots is
+	// tagged with a hash of the ramp it holds. Tags are only hints:
+	// a hit is confirmed against the configuration copy.
+
+	struct RampSlot {
+	    uint32_t hash;
+	    uint32_t lastUse;
+	};
+
+	RampSlot rampSlot[4][16];
+	uint32_t rampClock[4];
+	RampCacheStats rampStats[4];
+
+	// TCLK watching (see tclk.cpp.) The counts of level starts and
+	// events are kept by the watcher task, which only polls cards
+	// that have watchers or waiters.
+
+	enum { maxTclkWatches = 8 };
+
+	struct TclkWatch {
+	    TclkCallback func;
+	    void* arg;
+	    TclkCondition cond;
+	    uint16_t which;
+	};
+
+	TclkWatch tclkWatch[maxTclkWatches];
+	uint32_t volatile tclkInterest;
+	uint32_t volatile levelStarts[32];
+	uint32_t volatile eventsSeen[256];
+	uint16_t lastCounters[32];
+	uint16_t lastEvent;
+	bool tclkPrimed;
+	vwpp::v3_0::Event<> tclkSeen;
+
+	// A watcher whose condition happened, waiting to be called
+	// after the watcher task's pass over the cards.
+
+	struct TclkFired {
+	    Card* card;
+	    TclkWatch watch;
+	};
+
+	static TclkFired* tclkFired;
+	static size_t tclkFiredCount;
+
+	static void startTclkWatcher();
+	void waitTclkPass();
+	static int tclkTask();
+	void pollTclk();
+
+	// Writes deferred to the channels' idle windows (see sched.cpp.)
+	// Each holds the card address of its first word. No two queued
+	// writes cover the same word: a newer write, queued or direct,
+	// drops or trims the queued writes it overlaps. A card-wide
+	// write (the trigger map) has `chan` set to `wholeCard` and
+	// waits for all four channels to be idle.
+
+	enum { maxQueuedWrites = 16, wholeCard = 4 };
+
+	struct QueuedWrite {
+	    uint16_t chan;
+	    uint16_t addr;
+	    uint16_t n;
+	    unsigned long queued;
+	    uint16_t data[128];
+	};
+
+	QueuedWrite writeQueue[maxQueuedWrites];
+	size_t volatile queuedWrites;
+	bool flushing;
+
+	bool queueWrite(LockType const&, uint16_t chan, uint16_t,
+			uint16_t const*, uint16_t);
+	bool supersedeQueued(uint16_t, uint16_t const*, uint16_t);
+	bool issueWrite(LockType const&, QueuedWrite const&);
+	void serviceWrites();
+
 	static void gblIntHandler(Card*);
+	static void gblResetHandler(Card*);
 
 	void intHandler();
+	void resetStep();
+	void resetFinished(ResetState);
 
 	bool detect(LockType const&);
 
@@ -176,11 +582,168 @@ namespace V473 {
 	Card(uint8_t, uint8_t);
 	virtual ~Card();
 
-	void reset(LockType const&);
+	// Resets the card. startReset() returns as soon as the reset is
+	// under way; waitReset() blocks until it completes, fails or
+	// the timeout (in milliseconds) expires. reset() does both. A
+	// reset that doesn't finish within `v473_reset_deadline`
+	// milliseconds fails, and the card refuses commands until it's
+	// successfully reset.
+
+	bool startReset(LockType const&);
+	bool waitReset(int);
+	bool reset(LockType const&);
+	ResetState getResetState() const { return resetState; }
+
 	void generateInterrupts(bool);
 
+	uint8_t address() const { return dipAddr; }
+	uint8_t vector() const { return vecNum; }
+	uint16_t firmwareVersion() const { return fwVersion; }
+	uint16_t fpgaVersionNumber() const { return fpgaVersion; }
+
+	Statistics const& getStatistics() const { return stats; }
+
+	// Returns a running total of the time (in time base ticks) the
+	// card has spent processing mailbox commands. The difference
+	// of two readings taken while holding the lock is the hardware
+	// time of the commands issued in between. Read without the lock,
+	// the difference also counts other tasks' commands.
+
+	uint32_t busyTime(LockType const&) const { return busy; }
+	uint32_t busyTime() const { return busy; }
+
+	// When cached reads are enabled, reads of the ramp tables, maps,
+	// tables and trigger map are answered from the driver's copy of
+	// the card's configuration; only words the driver hasn't seen
+	// yet are read from the card. The copy is discarded when the
+	// card is reset.
+
+	void setCachedReads(LockType const&, bool const en)
+	{
+	    cachedReads = en;
+	}
+
+	bool getCachedReads(LockType const&) const { return cachedReads; }
+
 	uint16_t getActiveInterruptLevel(LockType const&);
 
+	// Writes a staged configuration without disturbing what's
+	// playing. The new ramps, scale factors, offsets, frequencies
+	// and phases go to slots no other level's map refers to, and
+	// the maps are written for an unused interrupt level. One
+	// trigger map write then moves the staged level's TCLK events
+	// to the new level. A level that no event triggers is simply
+	// rewritten. confirmCommit() checks, once, whether the new
+	// level has started playing; waitCommit() polls it, taking the
+	// lock for each poll, for up to `tmo` milliseconds.
+
+	bool commit(LockType const&, Stage const&, CommitResult&);
+	bool confirmCommit(LockType const&, CommitResult&);
+	bool waitCommit(CommitResult&, int);
+
+	// Double-buffered playback for the channels in `mask` (bit N is
+	// channel N.) The group starts at interrupt level `lvl`, which
+	// should be triggered by the event that paces the frames.
+	// playFrame() waits up to `tmo` milliseconds for the previous
+	// frame to start playing, writes the new ramps (`ramps[N]` is
+	// channel N's, `n` words each) to the idle buffer and hands the
+	// event to it. Commits alternate between the two interrupt
+	// levels of an even/odd pair.
+
+	static void initPingPong(PingPong&, uint16_t lvl, uint16_t mask);
+	bool playFrame(PingPong&, uint16_t const* const*, size_t, int);
+
+	// Makes interrupt level `intLvl` of the channel play the ramp in
+	// `ptr` (`n` words.) If one of the channel's ramp slots already
+	// holds the ramp, only the ramp map is written. Otherwise the
+	// least recently used slot that no other level refers to (nor
+	// `intLvl` itself, if it's triggered or playing) is overwritten.
+
+	bool playRamp(LockType const&, Channel const&, uint16_t intLvl,
+		      uint16_t const*, size_t);
+
+	RampCacheStats const& getRampCacheStats(LockType const&,
+						Channel const& chan) const
+	{
+	    return rampStats[chan];
+	}
+
+	void clearRampCacheStats(LockType const&);
+
+	// Waits up to `tmo` milliseconds for interrupt level `which` to
+	// start, or for TCLK event `which` to arrive. Returns false on
+	// timeout. The card is watched by a task that's woken by the
+	// card's interrupt, if the firmware raises one (see
+	// `v473_tclk_irq`), and otherwise polls the card's interrupt
+	// counters every `v473_tclk_poll_ms` milliseconds while anyone
+	// waits, or every `v473_tclk_watch_ms` for watchers alone.
+
+	bool waitTclk(TclkCondition, uint16_t which, int tmo);
+
+	bool readActivity(LockType const&, Channel const&, ChannelActivity&);
+
+	// Fills in a model of what interrupt level `intLvl` plays on the
+	// channel from the maps and tables. `rampBuf` (128 words)
+	// receives the ramp. The scale factor's unity and the starting
+	// values are left for the caller to set.
+
+	bool modelLevel(LockType const&, Channel const&, uint16_t intLvl,
+			uint16_t* rampBuf, ChannelModel&);
+
+	// Sine-mode sweeps (see sine.cpp.) planSweeps() packs the
+	// frequencies and phases of `n` sweeps into the 32-entry tables,
+	// sharing entries between sweeps where it can, and throws
+	// runtime_error if they don't fit. The sine mode is per channel,
+	// so the sweeps either all loop or none do. writeSweeps() places
+	// the planned entries around the ones other levels still refer
+	// to, and writes them, the planned levels' map entries and the
+	// sine mode, skipping what the card already holds; it throws
+	// runtime_error if there's no room. verifySweep() reads the
+	// channel's active and final sine frequency and phase and checks
+	// them against the plan.
+
+	static void planSweeps(SineSweep const*, size_t n, bool loop,
+			       SweepTables&);
+	bool writeSweeps(LockType const&, Channel const&, SweepTables const&);
+	bool verifySweep(LockType const&, Channel const&, SweepTables const&,
+			 SweepCheck&);
+
+	// Gives each interrupt level in the list its scale factor and
+	// offset. A value that a slot already holds shares that slot;
+	// otherwise the value goes to a slot that no other level's map
+	// refers to, and runtime_error is thrown if there isn't one. The
+	// old slots of a listed level that's triggered or playing are
+	// left alone until its map entries are written. Only the table
+	// and map words that change are written, in as few writes as
+	// possible.
+
+	bool assignScaling(LockType const&, Channel const&,
+			   LevelScaling const*, size_t n, ScalingSlots&);
+
+	// Writes that don't have to happen right away. Unless `urgent`
+	// is set, the write is queued and made once the channel isn't
+	// playing a ramp, together with the channel's other queued
+	// writes. A newer write to any of the same words, queued or
+	// made directly, replaces the older one's words. A write that
+	// has waited `v473_write_max_defer_ms` is made
+	// even if the channel never goes idle. flushWrites() makes the
+	// queued writes of idle channels now (or of all channels, if
+	// `force` is set) and returns the number made.
+
+	bool deferTable(LockType const&, TableWriter, Channel const&,
+			uint16_t, uint16_t const*, uint16_t, bool urgent);
+	bool deferRamp(LockType const&, Channel const&, uint16_t ramp,
+		       uint16_t offset, uint16_t const*, uint16_t,
+		       bool urgent);
+	size_t flushWrites(LockType const&, bool force);
+	size_t getQueuedWrites(LockType const&) const { return queuedWrites; }
+
+	// Registers a function to be called each time the condition
+	// happens. Returns a handle for removeTclkWatch().
+
+	int addTclkWatch(TclkCondition, uint16_t which, TclkCallback, void*);
+	void removeTclkWatch(int);
+
 	bool getIntCounters(LockType const& lock, uint16_t const start,
 			    uint16_t* const ptr, uint16_t const n)
 	{
@@ -294,6 +857,13 @@ namespace V473 {
 	bool getCurrentIntLvl(LockType const&, uint16_t*);
 	bool getLastTclkEvent(LockType const&, uint16_t*);
 	bool getPowerSupplyStatus(LockType const&, uint16_t, uint16_t*);
+
+	// Split-phase form of getPowerSupplyStatus(). The request is
+	// started on the card and finishRead() collects the reply. This
+	// lets a caller keep several cards busy at the same time.
+
+	bool startPowerSupplyStatus(LockType const&, Channel const&);
+	bool finishRead(LockType const&, uint16_t*, uint16_t);
 	bool getTclkInterruptEnable(LockType const&, bool*);
 	bool getDAC(LockType const&, uint16_t, uint16_t*);
 	bool getDiagCounters(LockType const&, uint16_t, uint16_t, uint16_t*);
@@ -367,6 +937,23 @@ namespace V473 {
 			     2 * offset, ptr, n);
 	}
 
+	// Writes `n` words of ramp data starting at segment `offset`
+	// of `ramp`; the data may run on into the following ramps. The
+	// upload is done one ramp at a time and the card is locked
+	// (with a timeout of `tmo` milliseconds) for each ramp, so
+	// other requests get in between them. While the card stores a
+	// ramp, the next one is compared with the driver's copy of the
+	// card's configuration; ramps that wouldn't change are skipped.
+
+	bool uploadRamps(Channel const&, uint16_t, uint16_t,
+			 uint16_t const*, size_t, int);
+
+	UploadProgress getUploadProgress(LockType const&,
+					 Channel const& chan) const
+	{
+	    return upload[chan];
+	}
+
 	bool setRampMap(LockType const& lock, Channel const& chan,
 			uint16_t const intLvl, uint16_t const* const ptr,
 			uint16_t const n)
@@ -417,14 +1004,486 @@ namespace V473 {
     };
 
     typedef Card* HANDLE;
+
+    // Time stamps taken from the processor's time base register.
+    // The difference between two stamps can be converted to
+    // microseconds with tbToUsec().
+
+    uint32_t timeStamp();
+    uint32_t tbToUsec(uint32_t);
+
+    // A histogram of times with power-of-two buckets. Bucket 0 counts
+    // times under 2 microseconds, bucket N counts times from 2^N up
+    // to 2^(N+1) microseconds and the last bucket also collects
+    // anything longer. Recording a time doesn't allocate and costs a
+    // handful of instructions.
+
+    class Histogram {
+     public:
+	enum { buckets = 16 };
+
+     private:
+	uint32_t count[buckets];
+
+     public:
+	Histogram() { clear(); }
+
+	void clear()
+	{
+	    for (size_t ii = 0; ii < buckets; ++ii)
+		count[ii] = 0;
+	}
+
+	static size_t bucketOf(uint32_t const usec)
+	{
+	    size_t const bit = 31 - __builtin_clz(usec | 1);
+
+	    return bit < buckets ? bit : buckets - 1;
+	}
+
+	void record(uint32_t const usec) { ++count[bucketOf(usec)]; }
+
+	uint32_t operator[](size_t const ii) const { return count[ii]; }
+    };
+
+    // Streams frames of ramps to a group of double-buffered channels
+    // (see Card::playFrame().) Producers push() frames into a bounded
+    // queue and a feeder task plays them in order. The queue takes
+    // no semaphore for one producer and the feeder (each end is
+    // published with interrupts briefly locked out), so push()
+    // mustn't be called by more than one task at a time.
+    //
+    // Each frame has a deadline, `deadline` milliseconds after it's
+    // pushed. A frame written by then counts as on time, otherwise as
+    // late. A frame pushed while the queue is full counts as
+    // overflowed; one that's already late when a newer frame is
+    // waiting is dropped without being played. The latencies are
+    // from push() to the frame being written, and to it being seen
+    // playing; the latter is measured when the next frame is played.
+
+    class Feeder {
+     public:
+	enum { maxFrames = 8 };
+
+	struct Stats {
+	    uint32_t pushed;
+	    uint32_t overflowed;
+	    uint32_t onTime;
+	    uint32_t late;
+	    uint32_t dropped;
+	    uint32_t failed;
+	    Histogram writeLatency;
+	    Histogram playLatency;
+	};
+
+     private:
+	struct Frame {
+	    uint16_t ramp[4][128];
+	    uint16_t n;
+	    uint32_t queued;
+	    unsigned long deadline;
+	};
+
+	Card* const card;
+	Card::PingPong pp;
+	int const deadline;
+	Frame* const frame;
+	uint32_t volatile head;
+	uint32_t volatile tail;
+	uint32_t lastQueued;
+	SEM_ID ready;
+	SEM_ID done;
+	bool volatile running;
+	Stats stats;
+
+	static int task(Feeder*);
+	void play(Frame const&);
+
+	Feeder();
+	Feeder(Feeder const&);
+	Feeder& operator=(Feeder const&);
+
+     public:
+	Feeder(Card*, uint16_t lvl, uint16_t mask, int deadline);
+	~Feeder();
+
+	// Queues a frame: `ramps[N]` is channel N's ramp, `n` words
+	// long. Returns false if the queue is full.
+
+	bool push(uint16_t const* const*, size_t n);
+
+	Stats getStats() const;
+	void clearStats();
+    };
+
+    // The crate registry. Every Card reserves its address and vector
+    // when its creation starts, adds itself once it's ready and
+    // removes itself when it's destroyed (or its creation fails.)
+    // Lookups by DIP address and interrupt vector are direct indexes;
+    // lookups by OID walk the (short) list of cards. None of them
+    // find a card that is still being probed.
+
+    size_t const maxCards = 32;
+    unsigned short const noOid = 0xffff;
+
+    struct CardInfo {
+	Card* card;
+	unsigned short oid;
+	uint8_t addr;
+	uint8_t vec;
+    };
+
+    struct CardStatus {
+	CardInfo info;
+	bool okay;
+	uint16_t psStatus[4];
+    };
+
+    void reserveCard(Card*);
+    void registerCard(Card*);
+    void unregisterCard(Card*);
+    void setCardOid(Card*, unsigned short);
+
+    Card* findByOid(unsigned short);
+    Card* findByAddress(uint8_t);
+    Card* findByVector(uint8_t);
+
+    // Copies the registry into the caller's buffer and returns the
+    // number of entries. No memory is allocated so it can be called
+    // every cycle. The cards may only be used while a CardSweep is
+    // held, since unregisterCard() waits for the sweeps to end
+    // before a card is freed.
+
+    size_t getCards(CardInfo*, size_t);
+
+    class CardSweep {
+	CardSweep(CardSweep const&);
+	CardSweep& operator=(CardSweep const&);
+
+     public:
+	CardSweep();
+	~CardSweep();
+    };
+
+    // Reads the power supply status of every channel of every card.
+    // The requests are started on all cards before any replies are
+    // collected, so the sweep takes about as long as one card.
+
+    size_t sweepStatus(CardStatus*, size_t);
+
+    // Ramp compilation (see ramp.cpp.) A ramp is a list of up to 63
+    // (value, delta) segments followed by a terminating segment with
+    // a delta of 0. Each segment moves the output linearly from the
+    // previous value to `value` over `delta` ticks of the card's 100
+    // kHz clock.
+
+    size_t const maxSegments = 63;
+    float const ticksPerSecond = 100000.f;
+
+    struct RampMetrics {
+	size_t segments;
+	float maxError;
+	float rmsError;
+    };
+
+    // Turns `n` samples of a waveform (in DAC counts), taken `rate`
+    // times a second, into few segments (in one greedy pass) that
+    // keep the ramp's output within `maxError` counts of every
+    // sample. Segments can't be shorter than a tick, so above 100 kHz
+    // the samples within a tick of a segment's start may exceed the
+    // error. The ramp starts from `start`. `ramp` must hold 2 * (budget + 1) words.
+    // Returns the number of words written, including the
+    // terminator, or 0 if more than `budget` segments are needed.
+    // If `metrics` isn't null, it's filled in by evaluateRamp().
+
+    size_t compileRamp(float const*, size_t n, float rate, float maxError,
+		       int16_t start, uint16_t* ramp, size_t budget,
+		       RampMetrics* metrics);
+
+    // Like compileRamp(), but finds the smallest error (to within
+    // half a count) that fits in `budget` segments.
+
+    size_t compileRampBudget(float const*, size_t n, float rate,
+			     size_t budget, int16_t start, uint16_t* ramp,
+			     RampMetrics* metrics);
+
+    // Measures how closely a ramp's output follows the samples.
+
+    void evaluateRamp(uint16_t const* ramp, float const*, size_t n,
+		      float rate, int16_t start, RampMetrics&);
+
+    // Waveform synthesis (see synth.cpp.) Each function writes a
+    // ramp, terminator included, into `ramp` (128 words) and returns
+    // the number of words written, or 0 if the shape needs more than
+    // 63 segments. Times are in ticks; a span longer than a delta can
+    // hold is split into several segments.
+
+    // One period of a sine wave of `period` ticks, in `segments`
+    // equal segments. `phase` is in 1/65536ths of a cycle.
+
+    size_t synthSine(uint16_t* ramp, size_t segments, uint32_t period,
+		     int16_t amplitude, int16_t offset, uint16_t phase);
+
+    // Rises from `base` to `top` in `rise` ticks, holds for `flat`
+    // and falls back in `fall`.
+
+    size_t synthTrapezoid(uint16_t* ramp, int16_t base, int16_t top,
+			  uint32_t rise, uint32_t flat, uint32_t fall);
+
+    // A parabolic-linear-parabolic move from `from` to `to` in
+    // `ticks`. The output accelerates along a parabola for the first
+    // `curve` ticks and decelerates for the last `curve`, and each
+    // parabola is drawn with `segments` segments.
+
+    size_t synthPlp(uint16_t* ramp, int16_t from, int16_t to, uint32_t ticks,
+		    uint32_t curve, size_t segments);
+
+    // Straight lines through a list of breakpoints. Times are from
+    // the trigger and must increase; the first segment moves from
+    // wherever the output was to the first breakpoint.
+
+    struct Breakpoint {
+	uint32_t time;
+	int16_t value;
+    };
+
+    size_t synthBreakpoints(uint16_t* ramp, Breakpoint const*, size_t n);
+
+    // One period of a sine wave in Q15, `sineSize` entries plus a
+    // copy of the first at the end, so neighbours can be
+    // interpolated without wrapping.
+
+    size_t const sineBits = 10;
+    size_t const sineSize = 1 << sineBits;
+
+    int16_t const* sineTable();
+
+    // Engineering-unit conversion (see units.cpp.) Each kind of
+    // value converts linearly, `eu = raw * scale + offset`, with the
+    // raw word taken as signed or unsigned as the card does. The
+    // defaults come from the DABBEL template in README.md: ramp
+    // values and offsets in amps, frequencies in kHz and phases in
+    // degrees. Scale factors are in units of 256 (unity), and delays
+    // and ramp segment times are in microseconds.
+
+    enum UnitKind {
+	ukRamp, ukOffset, ukScale, ukDelay, ukFrequency, ukPhase, ukTime,
+	ukKinds
+    };
+
+    struct UnitConv {
+	float scale;
+	float offset;
+	bool isSigned;
+    };
+
+    UnitConv getUnitConv(UnitKind);
+    void setUnitConv(UnitKind, float scale, float offset);
+
+    // Convert `n` values of a kind. toRaw() rounds to the nearest
+    // word and returns how many values had to be clipped to fit.
+
+    void toEngineering(UnitKind, uint16_t const* raw, float* eu, size_t n);
+    size_t toRaw(UnitKind, float const* eu, uint16_t* raw, size_t n);
+
+    // The same for `n` words of ramp data, whose (value, delta)
+    // pairs convert as ukRamp and ukTime.
+
+    void rampToEngineering(uint16_t const* raw, float* eu, size_t n);
+    size_t rampToRaw(float const* eu, uint16_t* raw, size_t n);
+
+    // A fixed-point model of a channel's output (see model.cpp.)
+    // The card's arithmetic isn't documented, so the model assumes
+    // 16.16 interpolation within segments, a scale factor where
+    // unity is 1 << `scaleShift` (7 for the 128 used by v473_test,
+    // 8 for the 256 used by PlayRamps), saturation to the DAC's
+    // 16-bit range, delays in ticks and, in sine mode, the ramp
+    // setting the amplitude of a sine wave whose `frequency` is in
+    // 1/65536ths of the tick rate (as with planSweeps().)
+
+    struct ChannelModel {
+	uint16_t const* ramp;
+	size_t rampWords;
+	int16_t rampStart;
+	int16_t initial;
+	int16_t scale;
+	unsigned scaleShift;
+	int16_t offset;
+	uint16_t delay;
+	bool sineMode;
+	uint16_t frequency;
+	uint16_t phase;
+    };
+
+    // Produces `n` ticks (at 100 kHz) of the channel's output,
+    // starting at the trigger. `work` must hold `n` words. The
+    // number of samples that had to be saturated, which the card
+    // counts as calculation overflows, is returned in `overflows`.
+
+    void simulateChannel(ChannelModel const&, int16_t* out, size_t n,
+			 int32_t* work, uint32_t* overflows);
+
+    // An XY vector display (see display.cpp.) Two channels drive an
+    // oscilloscope in XY mode. A picture is built from polylines and
+    // meshes of 3-D points, which render() projects through the view
+    // and turns into ramps for the two channels. Drawn lines share
+    // `drawTicks` in proportion to their length, so the beam moves at
+    // one speed and every line is equally bright. The card can't
+    // blank the beam, so a jump between lines is a one tick move,
+    // which shows only faintly.
+    //
+    // A picture longer than a ramp's 63 segments is split across
+    // several ramps, which play() plays in turn on the ping-pong
+    // levels starting at `lvl`. The level should be triggered by
+    // the event that paces the display; play() writes each ramp as
+    // soon as the card has started the one before it.
+
+    class VectorDisplay {
+     public:
+	enum { maxPoints = 256, maxRamps = 16 };
+	enum { maxStrokes = maxRamps * maxSegments };
+
+	struct Point {
+	    float x;
+	    float y;
+	    float z;
+	};
+
+	struct Edge {
+	    uint16_t from;
+	    uint16_t to;
+	};
+
+	struct Stats {
+	    uint32_t pictures;
+	    uint32_t ramps;
+	    uint32_t segments;
+	    uint32_t jumps;
+	};
+
+     private:
+	struct Stroke {
+	    uint16_t point;
+	    bool draw;
+	};
+
+	Card* const card;
+	Card::PingPong pp;
+	Card::Channel const chanX;
+	Card::Channel const chanY;
+	Point point[maxPoints];
+	size_t points;
+	Stroke stroke[maxStrokes];
+	float len[maxStrokes];
+	size_t strokes;
+	float view[3][3];
+	float shift[3];
+	float eye;
+	float scale;
+	uint16_t drawTicks;
+	uint16_t ramp[maxRamps][2][2 * (maxSegments + 1)];
+	size_t rampWords[maxRamps];
+	size_t ramps;
+	Stats stats;
+
+	uint16_t addPoint(Point const&);
+	void addStroke(uint16_t, bool);
+
+	VectorDisplay();
+	VectorDisplay(VectorDisplay const&);
+	VectorDisplay& operator=(VectorDisplay const&);
+
+     public:
+	VectorDisplay(Card*, uint16_t chanX, uint16_t chanY, uint16_t lvl);
+
+	// Empties the picture. The view is kept.
+
+	void clear();
+
+	// Adds a line through `n` points, back to the first if
+	// `closed`, or the edges of a mesh of `n` vertices. A mesh's
+	// edges are drawn in the order planPath() finds, with the
+	// fewest jumps. Throws runtime_error if the picture gets too
+	// big.
+
+	void polyline(Point const*, size_t n, bool closed);
+	void mesh(Point const*, size_t n, Edge const*, size_t edges);
+
+	// Points are rotated by `rot`, moved by `dx`, `dy` and `dz` and
+	// seen from `eye` units in front of the origin (0 for no
+	// perspective.) One unit is `counts` DAC counts.
+
+	void setView(float const rot[3][3], float dx, float dy, float dz,
+		     float eye, float counts);
+
+	// The time given to drawing the lines of a picture, in ticks.
+
+	void setDrawTime(uint16_t ticks);
+
+	// Turns the picture into ramps and returns how many there
+	// are. play() renders the picture and plays the ramps, waiting
+	// up to `tmo` milliseconds for each to be taken.
+
+	size_t render();
+	bool play(int tmo);
+
+	uint16_t const* rampX(size_t ii) const { return ramp[ii][0]; }
+	uint16_t const* rampY(size_t ii) const { return ramp[ii][1]; }
+	size_t words(size_t ii) const { return rampWords[ii]; }
+
+	Stats const& getStats() const { return stats; }
+	Card::PingPong const& getPingPong() const { return pp; }
+    };
+
+    // Plans the order to draw the `edges` edges of a graph of
+    // `vertices` vertices (see path.cpp.) Each edge is drawn once,
+    // in as few unbroken trails as the graph allows, so the path has
+    // the fewest jumps. Each step moves to `vertex`, drawing if
+    // `draw` is set; the first is a jump to the start of the first
+    // trail. `steps` must hold 2 * `edges` entries. Returns the
+    // number of steps, which is the number of edges plus the number
+    // of trails. The time taken is linear in the size of the graph.
+
+    struct PathStep {
+	uint16_t vertex;
+	bool draw;
+    };
+
+    size_t planPath(VectorDisplay::Edge const*, size_t edges,
+		    size_t vertices, PathStep* steps);
+
+    // Wakes the TCLK watcher task. Called by the interrupt handler.
+
+    void tclkNotify();
 };
 
 extern "C" {
     V473::HANDLE v473_create(int, int);
     STATUS v473_create_mooc_class(uint8_t);
     STATUS v473_create_mooc_instance(unsigned short, uint8_t, uint8_t);
+    STATUS v473_add_mooc_instance(unsigned short, uint8_t, uint8_t);
+    STATUS v473_model_bench(int);
+    V473::Feeder* v473_feeder_create(V473::HANDLE, int, int, int);
+    STATUS v473_feeder_show(V473::Feeder*);
+    STATUS v473_probe_mooc_instances(void);
+    STATUS v473_ramp_compile_bench(int, int);
+    STATUS v473_synth_bench(int);
+    STATUS v473_load_eu(V473::HANDLE, int, char const*);
+    STATUS v473_units_show(void);
+    STATUS v473_units_bench(int);
+    STATUS v473_sine_show(V473::HANDLE, int);
+    STATUS v473_ramp_cache_show(V473::HANDLE);
     STATUS v473_cube(V473::HANDLE);
+    STATUS v473_cube_bench(int);
+    STATUS v473_cube_show(void);
+    V473::VectorDisplay* v473_display_create(V473::HANDLE, int, int, int);
+    STATUS v473_display_show(V473::VectorDisplay*);
+    STATUS v473_display_bench(int);
     STATUS v473_destroy(V473::HANDLE);
+    STATUS v473_enable_all(int);
+    STATUS v473_show(void);
+    STATUS v473_subcode_stats(void);
+    STATUS v473_tclk_enable_all(int);
     STATUS v473_setupInterrupt(int, int, int, int, int, int, int, int, int);
     STATUS v473_test(V473::HANDLE, uint8_t);
     STATUS v473_autotest(V473::HANDLE);